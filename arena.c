@@ -0,0 +1,153 @@
+/* Arena allocation. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/*
+ * Size of the blocks small allocations are taken from. Allocations
+ * larger than a quarter of that get a block of their own, which can be
+ * resized with realloc().
+ */
+#define BLOCK	65536
+#define LARGE	(BLOCK / 4)
+
+/* All allocations are rounded up to this alignment. */
+#define ALIGN(n)	(((n) + 15) & ~(size_t)15)
+
+struct block {
+	struct block *next, *prev;
+	size_t size;	/* Usable size of the block. */
+	size_t used;	/* Bytes handed out so far. */
+};
+
+#define HDR		ALIGN(sizeof(struct block))
+#define DATA(b)		((char*)(b) + HDR)
+
+struct _Arena {
+	struct block *blocks;	/* All blocks. */
+	struct block *cur;	/* Block small allocations come from. */
+	void *last;		/* Most recent small allocation. */
+};
+
+/*
+ * Create an empty arena.
+ * Returns NULL on errors.
+ */
+Arena *arena_new(void) {
+	Arena *a;
+
+	if (!(a = malloc(sizeof(*a))))
+		return NULL;
+
+	a->blocks = a->cur = NULL;
+	a->last = NULL;
+	return a;
+}
+
+/* Allocate a new block of `size' usable bytes and link it in. */
+static struct block *newblock(Arena *a, size_t size) {
+	struct block *b;
+
+	if (!(b = malloc(HDR + size)))
+		return NULL;
+
+	b->size = size;
+	b->used = 0;
+	b->prev = NULL;
+	if ((b->next = a->blocks))
+		b->next->prev = b;
+	a->blocks = b;
+	return b;
+}
+
+/*
+ * Allocate `n' bytes from the arena. The memory is suitably aligned for
+ * any type.
+ * Returns NULL on errors.
+ */
+void *arena_alloc(Arena *a, size_t n) {
+	struct block *b;
+	void *p;
+
+	n = ALIGN(n ? n : 1);
+
+	if (n > LARGE) {
+		if (!(b = newblock(a, n)))
+			return NULL;
+		b->used = n;
+		return DATA(b);
+	}
+
+	if (!a->cur || a->cur->size - a->cur->used < n) {
+		if (!(b = newblock(a, BLOCK)))
+			return NULL;
+		a->cur = b;
+	}
+
+	p = DATA(a->cur) + a->cur->used;
+	a->cur->used += n;
+	a->last = p;
+	return p;
+}
+
+/*
+ * Resize the allocation `p' of `old' bytes to `n' bytes.
+ * Returns the new address, or NULL on errors.
+ */
+void *arena_realloc(Arena *a, void *p, size_t old, size_t n) {
+	struct block *b;
+	size_t off;
+	void *q;
+
+	if (!p)
+		return arena_alloc(a, n);
+
+	if (ALIGN(n) <= ALIGN(old))
+		return p;
+
+	/* The most recent small allocation may simply grow. */
+	if (p == a->last && ALIGN(n) <= LARGE) {
+		off = (char*)p - DATA(a->cur);
+		if (a->cur->size - off >= ALIGN(n)) {
+			a->cur->used = off + ALIGN(n);
+			return p;
+		}
+	}
+
+	/* Large allocations own their block. */
+	if (ALIGN(old) > LARGE) {
+		b = (struct block*)((char*)p - HDR);
+		if (!(b = realloc(b, HDR + ALIGN(n))))
+			return NULL;
+		b->size = b->used = ALIGN(n);
+		if (b->prev)
+			b->prev->next = b;
+		else
+			a->blocks = b;
+		if (b->next)
+			b->next->prev = b;
+		return DATA(b);
+	}
+
+	if (!(q = arena_alloc(a, n)))
+		return NULL;
+	memcpy(q, p, old);
+	return q;
+}
+
+/* Free the arena and all memory allocated from it. */
+void arena_free(Arena *a) {
+	struct block *b;
+
+	if (!a)
+		return;
+
+	while ((b = a->blocks)) {
+		a->blocks = b->next;
+		free(b);
+	}
+
+	free(a);
+}
@@ -0,0 +1,42 @@
+/*
+ * Arena allocation.
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/*
+ * An arena hands out memory from large blocks. There is no way to free
+ * single allocations; all of them are released at once by `arena_free'.
+ */
+typedef struct _Arena Arena;
+
+/*
+ * Create an empty arena.
+ * Returns NULL on errors.
+ */
+Arena *arena_new(void);
+
+/*
+ * Allocate `n' bytes from the arena. The memory is suitably aligned for
+ * any type.
+ * Returns NULL on errors.
+ */
+void *arena_alloc(Arena *a, size_t n);
+
+/*
+ * Resize the allocation `p' of `old' bytes, which must be the size `p'
+ * was last allocated or resized with, to `n' bytes. If `p' is NULL,
+ * this is the same as `arena_alloc'. The most recent allocation and
+ * large allocations are resized in place if possible.
+ * Returns the new address, or NULL on errors, in which case `p' is left
+ * untouched.
+ */
+void *arena_realloc(Arena *a, void *p, size_t old, size_t n);
+
+/* Free the arena and all memory allocated from it. */
+void arena_free(Arena *a);
+
+#endif /* __ARENA_H__ */
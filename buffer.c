@@ -5,16 +5,49 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "buffer.h"
 
-/* Buffer structure containing the midifile. */
+/*
+ * Initial and maximum window size of stream buffers and the number of
+ * bytes kept in front of the current position when the window slides.
+ * The maximum is a power of two multiple of the initial size, so that
+ * the window ends up at it exactly.
+ */
+#define WINDOW		65536
+#define MAXWINDOW	(16 * WINDOW)
+#define LOOKBACK	4096
+
+/*
+ * Buffer structure containing the midifile. The public part holds the
+ * cursor; `c.base' is always the same as `b'.
+ */
 typedef struct {
-	unsigned long n;	/* Size of buffer. */
-	unsigned long i;	/* Current position within buffer. */
+	MBUF c;			/* Cursor, see buffer.h. */
+	unsigned long cap;	/* Allocated size of buffer. */
 	unsigned char *b;	/* Pointer to data. */
+	char mapped;		/* Data is a read-only file mapping. */
+	char view;		/* Data belongs to another buffer. */
+	FILE *f;		/* Source of stream buffers, else NULL. */
+	int err;		/* Read error of stream buffers, else 0. */
 } _MBUF;
 
+/* Size of and current position within the data. */
+#define SIZE(b)	((unsigned long)((b)->c.end - (b)->c.base))
+#define POS(b)	((unsigned long)((b)->c.cur - (b)->c.base))
+
+/* Set the data pointer, size and position of `b'. */
+static void setdata(_MBUF *b, unsigned char *data, unsigned long n,
+    unsigned long i) {
+	b->b = data;
+	b->c.base = data;
+	b->c.end = data + n;
+	b->c.cur = data + i;
+}
+
 /* Create an mbuf. */
 MBUF *mbuf_new(void) {
 	_MBUF *b;
@@ -22,35 +55,185 @@ MBUF *mbuf_new(void) {
 	if (!(b = malloc(sizeof(*b))))
 		return NULL;
 
-	b->n = b->i = 0;
-	b->b = NULL;
+	setdata(b, NULL, 0, 0);
+	b->c.off = 0;
+	b->cap = 0;
+	b->mapped = 0;
+	b->view = 0;
+	b->f = NULL;
+	b->err = 0;
+
+	return (MBUF*)b;
+}
+
+/*
+ * Create a read-only buffer for the `n' bytes of `src' at position
+ * `pos' without copying them. `src' must be stable.
+ * Returns NULL on errors.
+ */
+MBUF *mbuf_view(MBUF *_src, unsigned long pos, unsigned long n) {
+	_MBUF *src = (_MBUF*)_src;
+	_MBUF *b;
+
+	if (src->f || pos > SIZE(src) || n > SIZE(src) - pos) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!(b = (_MBUF*)mbuf_new()))
+		return NULL;
+
+	setdata(b, src->b + pos, n, 0);
+	b->cap = n;
+	b->view = 1;
 
 	return (MBUF*)b;
 }
 
+/*
+ * Make sure that at least `size' bytes are allocated. The allocation
+ * grows geometrically to keep the number of reallocs logarithmic.
+ * Returns 0 on success, else -1.
+ */
+static int grow(_MBUF *b, unsigned long size) {
+	unsigned char *nb;
+	unsigned long cap;
+
+	if (size <= b->cap)
+		return 0;
+
+	cap = b->cap ? b->cap : 1024;
+	while (cap < size)
+		cap += cap;
+
+	if (!(nb = realloc(b->b, cap)))
+		return -1;
+
+	setdata(b, nb, SIZE(b), POS(b));
+	b->cap = cap;
+	return 0;
+}
+
+/*
+ * Make sure that the buffer contains at least `n' bytes from the
+ * current position on. For stream buffers, more data is read if
+ * necessary and data more than LOOKBACK bytes in front of the position
+ * is discarded. Requests that don't fit into the largest window fail
+ * right away, and read errors are kept for `mbuf_error'.
+ * Returns nonzero if the request could be satisfied.
+ */
+int mbuf_fill(MBUF *_b, unsigned long n) {
+	_MBUF *b = (_MBUF*)_b;
+	unsigned long drop;
+	ssize_t size;
+
+	if (b->f && SIZE(b) - POS(b) < n && n > MAXWINDOW - LOOKBACK)
+		return 0;
+
+	while (b->f && !b->err && SIZE(b) - POS(b) < n) {
+		if (POS(b) > LOOKBACK) {
+			drop = POS(b) - LOOKBACK;
+			memmove(b->b, b->b + drop, SIZE(b) - drop);
+			b->c.off += drop;
+			b->c.end -= drop;
+			b->c.cur -= drop;
+		}
+
+		if (SIZE(b) == b->cap && grow(b, b->cap ? b->cap + 1 : WINDOW))
+			return 0;
+
+		size = read(fileno(b->f), b->b + SIZE(b), b->cap - SIZE(b));
+		if (size < 0 && errno == EINTR)
+			continue;
+		if (size < 0)
+			b->err = errno;
+		if (size <= 0)
+			break;
+		b->c.end += size;
+	}
+
+	return SIZE(b) - POS(b) >= n;
+}
+
 /*
  * Read the file into the buffer.
  * Returns 0 on success, else -1.
  */
 int read_mbuf(MBUF *_b, FILE *f) {
 	_MBUF *b = (_MBUF*)_b;
-	char buf[1024];
-	long size = 0;
-
-	b->i = b->n = 0;
-	b->b = NULL;
-	while ((size = fread(buf, 1, 1024, f)) > 0) {
-		b->n += size;
-		if (!(b->b = realloc(b->b, b->n)))
+	size_t size;
+
+	setdata(b, NULL, 0, 0);
+	b->cap = 0;
+	do {
+		if (grow(b, SIZE(b) + 1024)) {
+			free(b->b);
+			setdata(b, NULL, 0, 0);
 			return -1;
-		memcpy(b->b + b->i, buf, size);
-		b->i += size;
-	}
+		}
+		size = fread(b->b + SIZE(b), 1, b->cap - SIZE(b), f);
+		b->c.end += size;
+	} while (size > 0);
 	if (ferror(f)) {
 		free(b->b);
+		setdata(b, NULL, 0, 0);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Map the file into the buffer. If `f' is not a regular file or cannot
+ * be mapped, fall back to `read_mbuf'.
+ * Returns 0 on success, else -1.
+ */
+int map_mbuf(MBUF *_b, FILE *f) {
+	_MBUF *b = (_MBUF*)_b;
+	struct stat st;
+	void *p;
+
+	/* Only map complete files; pipes and ttys are read as usual. */
+	if (fstat(fileno(f), &st) || !S_ISREG(st.st_mode) ||
+	    st.st_size <= 0 || ftello(f) != 0)
+		return read_mbuf(_b, f);
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	if (p == MAP_FAILED)
+		return read_mbuf(_b, f);
+
+	setdata(b, p, st.st_size, 0);
+	b->cap = st.st_size;
+	b->mapped = 1;
+
+	return 0;
+}
+
+/*
+ * Read the file on demand through a sliding window.  Regular files are
+ * mapped as with `map_mbuf' instead.
+ * Returns 0 on success, else -1.
+ */
+int stream_mbuf(MBUF *_b, FILE *f) {
+	_MBUF *b = (_MBUF*)_b;
+	struct stat st;
+
+	if (!fstat(fileno(f), &st) && S_ISREG(st.st_mode))
+		return map_mbuf(_b, f);
+
+	setdata(b, NULL, 0, 0);
+	b->c.off = b->cap = 0;
+	b->f = f;
+	b->err = 0;
+
+	if (!mbuf_fill(_b, 1) && b->err) {
+		errno = b->err;
+		free(b->b);
+		setdata(b, NULL, 0, 0);
+		b->f = NULL;
+		b->err = 0;
 		return -1;
 	}
-	b->i = 0;
 
 	return 0;
 }
@@ -61,45 +244,70 @@ int read_mbuf(MBUF *_b, FILE *f) {
  */
 int write_mbuf(MBUF *_b, FILE *f) {
 	_MBUF *b = (_MBUF*)_b;
-	if (b->n > 0 && fwrite(b->b, b->n, 1, f) != 1)
+	if (SIZE(b) > 0 && fwrite(b->b, SIZE(b), 1, f) != 1)
 		return -1;
 	else
 		return 0;
 }
 
 /* Get the current position of a buffer. */
-unsigned long mbuf_pos(MBUF *_b) {
-	_MBUF *b = (_MBUF*)_b;
-	return b->i;
+unsigned long mbuf_pos(MBUF *b) {
+	return mbuf_tell(b);
 }
 
 /*
  * Set the position of a buffer.
  * If the position is negative, set relative to the end of buffer.
  * Returns the new position which may be different from `pos' if `pos'
- * is out of range.
+ * is out of range, or MBUF_LOST if it can't be reached on a stream.
  */
 unsigned long mbuf_set(MBUF *_b, long pos) {
 	_MBUF *b = (_MBUF*)_b;
+	unsigned long n;
+
+	/* The end of a stream is unknown, and its start is gone. */
+	if (b->f && (pos < 0 || (unsigned long)pos < b->c.off)) {
+		errno = ESPIPE;
+		return MBUF_LOST;
+	}
+
 	if (pos < 0)
-		pos = b->n + pos;
+		pos += SIZE(b);
 	if (pos < 0)
-		b->i = 0;
-	else if (pos <= b->n)
-		b->i = pos;
-	return b->i;
+		b->c.cur = b->c.base;
+	else if ((unsigned long)pos <= b->c.off + SIZE(b))
+		b->c.cur = b->c.base + ((unsigned long)pos - b->c.off);
+	else if (b->f) {
+		/* Streams are read on, a window at a time. */
+		n = (unsigned long)pos - mbuf_tell(_b);
+		while (n > 0 && mbuf_fill(_b, 1)) {
+			if (SIZE(b) - POS(b) < n) {
+				n -= SIZE(b) - POS(b);
+				b->c.cur = b->c.end;
+			} else {
+				b->c.cur += n;
+				n = 0;
+			}
+		}
+	}
+	return mbuf_tell(_b);
+}
+
+/*
+ * Get the error that occurred while reading a stream buffer.
+ * Returns the error number, or 0 if there was none.
+ */
+int mbuf_error(MBUF *_b) {
+	_MBUF *b = (_MBUF*)_b;
+	return b->err;
 }
 
 /*
  * Returns nonzero if the buffer contains at least n bytes from the
  * current position to the end.
  */
-int mbuf_request(MBUF *_b, unsigned long n) {
-	_MBUF *b = (_MBUF*)_b;
-	if (b->i < b->n)
-		return b->n - b->i >= n;
-	else
-		return 0 >= n;
+int mbuf_request(MBUF *b, unsigned long n) {
+	return mbuf_have(b, n);
 }
 
 /*
@@ -107,12 +315,43 @@ int mbuf_request(MBUF *_b, unsigned long n) {
  * the position.
  * Returns the character or EOF if the end of the buffer is reached.
  */
-int mbuf_get(MBUF *_b) {
+int mbuf_get(MBUF *b) {
+	return mbuf_getc(b);
+}
+
+/*
+ * Copy the next `n' bytes of the buffer to `dst' and advance the
+ * position.
+ * Returns 0 on success, or -1 if there are less than `n' bytes left.
+ */
+int mbuf_read(MBUF *b, void *dst, unsigned long n) {
+	if (!mbuf_have(b, n))
+		return -1;
+	memcpy(dst, b->cur, n);
+	b->cur += n;
+	return 0;
+}
+
+/*
+ * Get a pointer to the next `n' bytes of the buffer and advance the
+ * position.
+ * Returns NULL if there are less than `n' bytes left.
+ */
+const unsigned char *mbuf_borrow(MBUF *b, unsigned long n) {
+	const unsigned char *p;
+	if (!mbuf_have(b, n))
+		return NULL;
+	p = b->cur;
+	b->cur += n;
+	return p;
+}
+
+/*
+ * Returns nonzero if the data of `b' stays in place while it is read.
+ */
+int mbuf_stable(MBUF *_b) {
 	_MBUF *b = (_MBUF*)_b;
-	if (b->i >= b->n)
-		return EOF;
-	else
-		return (b->b[b->i++]) & 0xff;
+	return !b->f;
 }
 
 /*
@@ -124,16 +363,54 @@ int mbuf_get(MBUF *_b) {
 int mbuf_put(MBUF *_b, int ch) {
 	_MBUF *b = (_MBUF*)_b;
 	ch &= 0xff;
-	if (b->i >= b->n && !(b->b = realloc(b->b, ++b->n)))
+	if (b->mapped || b->view || b->f)
 		return EOF;
-	return (b->b[b->i++] = ch) & 0xff;
+	if (b->c.cur >= b->c.end) {
+		if (grow(b, SIZE(b) + 1))
+			return EOF;
+		b->c.end++;
+	}
+	b->b[POS(b)] = ch;
+	b->c.cur++;
+	return ch;
+}
+
+/*
+ * Put `n' bytes from `src' at the current position in the buffer and
+ * advance the position, enlarging the buffer as with `mbuf_put'.
+ * Returns 0 on success, else -1.
+ */
+int mbuf_write(MBUF *_b, const void *src, unsigned long n) {
+	_MBUF *b = (_MBUF*)_b;
+	if (b->mapped || b->view || b->f || grow(b, POS(b) + n))
+		return -1;
+	memcpy(b->b + POS(b), src, n);
+	b->c.cur += n;
+	if (b->c.cur > b->c.end)
+		b->c.end = b->c.cur;
+	return 0;
+}
+
+/*
+ * Make sure that `n' bytes can be put at the current position without
+ * enlarging the buffer again.
+ * Returns 0 on success, else -1.
+ */
+int mbuf_reserve(MBUF *_b, unsigned long n) {
+	_MBUF *b = (_MBUF*)_b;
+	if (b->mapped || b->view || b->f)
+		return -1;
+	return grow(b, POS(b) + n);
 }
 
 /* Free the data of `b'. */
 void mbuf_free(MBUF *_b) {
 	_MBUF *b = (_MBUF*)_b;
 	if (b) {
-		free(b->b);
+		if (b->mapped)
+			munmap(b->b, SIZE(b));
+		else if (!b->view)
+			free(b->b);
 		b->b = NULL;
 		free(b);
 	}
@@ -147,14 +424,16 @@ void mbuf_free(MBUF *_b) {
 int mbuf_insert(MBUF *_b1, MBUF *_b2) {
 	_MBUF *b1 = (_MBUF*)_b1;
 	_MBUF *b2 = (_MBUF*)_b2;
-	if (!b2->n)  /* b2 empty */
+	unsigned long n = SIZE(b2);
+	if (!n)  /* b2 empty */
 		return 0;
-	if (!(b1->b = realloc(b1->b, b1->n + b2->n)))
+	if (b1->mapped || b1->view || b1->f || grow(b1, SIZE(b1) + n))
 		return -1;
-	if (b1->i < b1->n)
-		memmove(b1->b + b1->i + b2->n, b1->b + b1->i, b2->n);
-	memcpy(b1->b + b1->i, b2->b, b2->n);
-	b1->n += b2->n;
-	b2->i += b2->n;
+	if (POS(b1) < SIZE(b1))
+		memmove(b1->b + POS(b1) + n, b1->b + POS(b1),
+		    SIZE(b1) - POS(b1));
+	memcpy(b1->b + POS(b1), b2->b, n);
+	b1->c.end += n;
+	b2->c.cur = b2->c.end;
 	return 0;
 }
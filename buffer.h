@@ -9,20 +9,62 @@
 
 /*
  * Buffer structure containing the midifile.
+ * Only the read cursor is public. It must not be modified directly
+ * except through the inline functions at the end of this file, which
+ * allow the readers to scan the data without a function call per byte.
+ * The data between `base' and `end' is all that is available without
+ * calling `mbuf_fill'; for stream buffers, `base' may move when reading
+ * on.
  */
-typedef struct { void *dummy; } MBUF;
+typedef struct {
+	const unsigned char *cur;	/* Current position. */
+	const unsigned char *end;	/* End of available data. */
+	const unsigned char *base;	/* Start of available data. */
+	unsigned long off;		/* Buffer position of `base'. */
+} MBUF;
 
 /*
  * Create an mbuf.
  */
 MBUF *mbuf_new(void);
 
+/*
+ * Create a read-only buffer for the `n' bytes of `src' at position
+ * `pos' without copying them. The new buffer has a position of its own,
+ * starting at 0. `src' must be stable (see `mbuf_stable') and must
+ * outlive the view.
+ * Returns NULL on errors.
+ */
+MBUF *mbuf_view(MBUF *src, unsigned long pos, unsigned long n);
+
 /*
  * Read the file into the buffer.
  * Returns 0 on success, else -1.
  */
 int read_mbuf(MBUF *b, FILE *f);
 
+/*
+ * Map the file into the buffer. If `f' is not a regular file or cannot
+ * be mapped, fall back to `read_mbuf'. A mapped buffer is read-only,
+ * i.e. `mbuf_put' and `mbuf_insert' fail on it. The file may be closed
+ * afterwards.
+ * Returns 0 on success, else -1.
+ */
+int map_mbuf(MBUF *b, FILE *f);
+
+/*
+ * Read the file on demand through a sliding window instead of loading
+ * it at once. Regular files are mapped as with `map_mbuf' instead.
+ * Only a few kilobytes in front of the current position are retained,
+ * so `mbuf_set' can't go back further than that, nor to a position
+ * relative to the end. The window doesn't grow beyond a megabyte, so
+ * larger requests fail. Read errors end the stream and are kept for
+ * `mbuf_error'. The buffer is read-only and `f' must stay open until
+ * the buffer is freed.
+ * Returns 0 on success, else -1.
+ */
+int stream_mbuf(MBUF *b, FILE *f);
+
 /*
  * Write the buffer to the file.
  * Returns -1 on error and 0 on success.
@@ -34,14 +76,25 @@ int write_mbuf(MBUF *b, FILE *f);
  */
 unsigned long mbuf_pos(MBUF *b);
 
+/* Result of `mbuf_set' for positions a stream buffer can't go to. */
+#define MBUF_LOST	((unsigned long)-1)
+
 /*
  * Set the position of a buffer.
  * If the position is negative, set relative to the end of buffer.
  * Returns the new position which may be different from `pos' if `pos'
- * is out of range.
+ * is out of range. On stream buffers, positions before the window or
+ * relative to the end can't be set; the position is left unchanged,
+ * errno is set and MBUF_LOST is returned.
  */
 unsigned long mbuf_set(MBUF *b, long pos);
 
+/*
+ * Get the error that occurred while reading a stream buffer.
+ * Returns the error number, or 0 if there was none.
+ */
+int mbuf_error(MBUF *b);
+
 /*
  * Returns nonzero if the buffer contains at least n bytes from the
  * current position to the end.
@@ -55,6 +108,29 @@ int mbuf_request(MBUF *b, unsigned long n);
  */
 int mbuf_get(MBUF *b);
 
+/*
+ * Copy the next `n' bytes of the buffer to `dst' and advance the
+ * position.
+ * Returns 0 on success, or -1 if there are less than `n' bytes left. In
+ * the latter case, the position is not changed.
+ */
+int mbuf_read(MBUF *b, void *dst, unsigned long n);
+
+/*
+ * Get a pointer to the next `n' bytes of the buffer and advance the
+ * position. The data must not be modified; it stays valid until the
+ * buffer is changed, freed or, for stream buffers, read any further.
+ * Returns NULL if there are less than `n' bytes left.
+ */
+const unsigned char *mbuf_borrow(MBUF *b, unsigned long n);
+
+/*
+ * Returns nonzero if the data of `b' stays in place while it is read,
+ * i.e. if pointers returned by `mbuf_borrow' are valid until the buffer
+ * is changed or freed. This is not the case for stream buffers.
+ */
+int mbuf_stable(MBUF *b);
+
 /*
  * Put a character at the current position in the buffer and advance the
  * position. If the current position is a the end of the buffer, the
@@ -63,6 +139,21 @@ int mbuf_get(MBUF *b);
  */
 int mbuf_put(MBUF *b, int ch);
 
+/*
+ * Put `n' bytes from `src' at the current position in the buffer and
+ * advance the position, enlarging the buffer as with `mbuf_put'.
+ * Returns 0 on success, else -1.
+ */
+int mbuf_write(MBUF *b, const void *src, unsigned long n);
+
+/*
+ * Make sure that `n' bytes can be put at the current position without
+ * enlarging the buffer again. Buffers grow geometrically anyway; this
+ * only saves the intermediate steps if the size is known in advance.
+ * Returns 0 on success, else -1.
+ */
+int mbuf_reserve(MBUF *b, unsigned long n);
+
 /*
  * Free the data of `b'.
  */
@@ -75,4 +166,36 @@ void mbuf_free(MBUF *b);
  */
 int mbuf_insert(MBUF *b1, MBUF *b2);
 
+/*
+ * Make sure that the buffer contains at least `n' bytes from the
+ * current position on. This is the slow path of the inline functions
+ * below; it reads more data into stream buffers if necessary.
+ * Returns nonzero if the request could be satisfied.
+ */
+int mbuf_fill(MBUF *b, unsigned long n);
+
+/* Inline version of `mbuf_request'. */
+static inline int mbuf_have(MBUF *b, unsigned long n) {
+	return (unsigned long)(b->end - b->cur) >= n || mbuf_fill(b, n);
+}
+
+/* Inline version of `mbuf_get'. */
+static inline int mbuf_getc(MBUF *b) {
+	return b->cur < b->end || mbuf_fill(b, 1) ? *b->cur++ : EOF;
+}
+
+/*
+ * Get the character at the current position of the buffer without
+ * advancing the position.
+ * Returns the character or EOF if the end of the buffer is reached.
+ */
+static inline int mbuf_peekc(MBUF *b) {
+	return b->cur < b->end || mbuf_fill(b, 1) ? *b->cur : EOF;
+}
+
+/* Inline version of `mbuf_pos'. */
+static inline unsigned long mbuf_tell(MBUF *b) {
+	return b->off + (b->cur - b->base);
+}
+
 #endif /* __BUFFER_H__ */
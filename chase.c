@@ -0,0 +1,227 @@
+/* Chasing the state of the midi channels. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chase.h"
+
+/* Average # of events between snapshots. */
+#define CHASEPERIOD	4096
+
+/* Controllers of special meaning. */
+#define DATAENTRY	6
+#define DATAENTRYLSB	38
+#define RESETALL	121
+#define ALLNOTESOFF	123
+
+/*
+ * Sort keys of the events that set the values of a channel state (see
+ * `event_key'), so that the tracks can be walked through one after
+ * the other: a value is only set by an event that comes later than the
+ * one which set it before.
+ */
+struct stamps {
+	uint64_t program[16];
+	uint64_t bend[16];
+	uint64_t ctrl[16][120];
+};
+
+/* Set all values of `cs' to unset. */
+static void clear(ChanState *cs, struct stamps *st) {
+	memset(cs, -1, sizeof(*cs));
+	memset(st, 0, sizeof(*st));
+}
+
+/* Apply the event `e' to the state `cs'. */
+static void apply(ChanState *cs, struct stamps *st, const MFEvent *e) {
+	int c = CHN(e->msg), i;
+	uint64_t key;
+
+	switch (e->msg.cmd & 0xf0) {
+	case CONTROLCHANGE:
+		i = e->msg.controlchange.controller;
+		key = event_key(e);
+		if (i < 120 && key >= st->ctrl[c][i]) {
+			cs->ctrl[c][i] = e->msg.controlchange.value;
+			st->ctrl[c][i] = key;
+		} else if (i == RESETALL) {
+			for (i = 0; i < 120; i++)
+				if (key >= st->ctrl[c][i]) {
+					cs->ctrl[c][i] = -1;
+					st->ctrl[c][i] = key;
+				}
+			if (key >= st->bend[c]) {
+				cs->bend[c] = -1;
+				st->bend[c] = key;
+			}
+		}
+		break;
+	case PROGRAMCHANGE:
+		if ((key = event_key(e)) >= st->program[c]) {
+			cs->program[c] = e->msg.programchange.program;
+			st->program[c] = key;
+		}
+		break;
+	case PITCHWHEELCHANGE:
+		if ((key = event_key(e)) >= st->bend[c]) {
+			cs->bend[c] = e->msg.pitchwheelchange.msb << 7 |
+			    e->msg.pitchwheelchange.lsb;
+			st->bend[c] = key;
+		}
+		break;
+	}
+}
+
+/*
+ * Build the snapshot table of `s'. The snapshots are spread evenly
+ * over the ticks of the score, a few thousand events apart. The
+ * tracks are walked through one after the other between snapshots and
+ * rewound.
+ * Returns NULL on errors.
+ */
+ChaseTable *chase_new(Score *s) {
+	unsigned long nevents = 0, last = 0, period, i;
+	struct stamps st;
+	MFEvent **next, *e;
+	ChaseTable *c;
+	ChanState cs;
+	long t;
+
+	for (t = 0; t < s->ntrk; t++) {
+		nevents += track_nevents(s->tracks[t]);
+		track_rewind(s->tracks[t]);
+		if ((e = track_step(s->tracks[t], 1)) && e->time > last)
+			last = e->time;
+	}
+	period = last / (nevents / CHASEPERIOD + 1) + 1;
+
+	if (!(c = malloc(sizeof(*c))))
+		return NULL;
+	c->nsnap = last / period + 1;
+	c->snap = malloc(c->nsnap * sizeof(*c->snap));
+	next = malloc(s->ntrk * sizeof(*next));
+	if (!c->snap || (s->ntrk && !next)) {
+		free(next);
+		chase_free(c);
+		return NULL;
+	}
+
+	for (t = 0; t < s->ntrk; t++) {
+		track_rewind(s->tracks[t]);
+		next[t] = track_step(s->tracks[t], 0);
+	}
+
+	clear(&cs, &st);
+	for (i = 0; i < c->nsnap; i++) {
+		c->snap[i].time = i * period;
+		for (t = 0; t < s->ntrk; t++)
+			for (; next[t] && next[t]->time < c->snap[i].time;
+			    next[t] = track_step(s->tracks[t], 0))
+				apply(&cs, &st, next[t]);
+		c->snap[i].state = cs;
+	}
+
+	for (t = 0; t < s->ntrk; t++)
+		track_rewind(s->tracks[t]);
+	free(next);
+	return c;
+}
+
+/*
+ * Get the state of the channels of `s' before the events of tick `time'
+ * into `cs', starting from the last snapshot before.
+ * Returns 1 on success, else 0.
+ */
+int chase_state(const ChaseTable *c, Score *s, unsigned long time,
+    ChanState *cs) {
+	unsigned long lo = 0, hi = c->nsnap, mid;
+	struct stamps st;
+	ScoreIter *it;
+	MFEvent *e;
+
+	/* Find the last snapshot at or before `time'. */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (c->snap[mid].time <= time)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	*cs = c->snap[lo].state;
+	if (c->snap[lo].time == time)
+		return 1;
+
+	/* The events are applied in order, so any stamps will do. */
+	memset(&st, 0, sizeof(st));
+	if (!(it = score_iter_at(s, c->snap[lo].time)))
+		return 0;
+	while ((e = score_iter_step(it, NULL)) && e->time < time)
+		apply(cs, &st, e);
+	score_iter_free(it);
+
+	return 1;
+}
+
+/* Store a control change at `e'. */
+static void control(MFEvent *e, int c, int controller, int value) {
+	e->time = 0;
+	e->msg.cmd = CONTROLCHANGE | c;
+	e->msg.controlchange.controller = controller;
+	e->msg.controlchange.value = value;
+}
+
+/*
+ * Store the events that restore the state `cs' at `e', which must have
+ * room for CHASEMAX events: for each channel, the controllers, the
+ * program and the pitch wheel. If `notesoff' is nonzero, each channel
+ * starts with a Reset All Controllers and an All Notes Off, so that
+ * values which are unset in `cs' return to their defaults as well.
+ * Controllers are sent in ascending order, so bank selects come before
+ * the program. Data entry and the (non-)registered parameter numbers
+ * are left out, as their values only make sense in the order they were
+ * sent.
+ * Returns the number of events.
+ */
+unsigned long chase_events(const ChanState *cs, int notesoff, MFEvent *e) {
+	unsigned long n = 0;
+	int c, i;
+
+	for (c = 0; c < 16; c++) {
+		if (notesoff) {
+			control(&e[n++], c, RESETALL, 0);
+			control(&e[n++], c, ALLNOTESOFF, 0);
+		}
+
+		for (i = 0; i < 120; i++)
+			if (cs->ctrl[c][i] >= 0 && i != DATAENTRY &&
+			    i != DATAENTRYLSB && (i < 96 || i > 101))
+				control(&e[n++], c, i, cs->ctrl[c][i]);
+
+		if (cs->program[c] >= 0) {
+			e[n].time = 0;
+			e[n].msg.cmd = PROGRAMCHANGE | c;
+			e[n].msg.programchange.program = cs->program[c];
+			n++;
+		}
+
+		if (cs->bend[c] >= 0) {
+			e[n].time = 0;
+			e[n].msg.cmd = PITCHWHEELCHANGE | c;
+			e[n].msg.pitchwheelchange.lsb = cs->bend[c] & 0x7f;
+			e[n].msg.pitchwheelchange.msb = cs->bend[c] >> 7;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/* Free a snapshot table. */
+void chase_free(ChaseTable *c) {
+	if (c) {
+		free(c->snap);
+		free(c);
+	}
+}
@@ -0,0 +1,74 @@
+/* Chasing the state of the midi channels. */
+
+#ifndef __CHASE_H__
+#define __CHASE_H__
+
+#include "event.h"
+#include "score.h"
+
+/* Maximum # of events of `chase_events'. */
+#define CHASEMAX	(16 * 123)
+
+/*
+ * The state of the midi channels at some time: the program, the
+ * controllers and the pitch wheel of each channel, or -1 where none
+ * was set yet. Channel mode messages (controllers 120 to 127) are not
+ * part of the state.
+ */
+typedef struct {
+	short program[16];
+	short bend[16];			/* 14 bit value. */
+	signed char ctrl[16][120];
+} ChanState;
+
+/* The state before the events of tick `time'. */
+typedef struct {
+	unsigned long time;
+	ChanState state;
+} ChaseSnap;
+
+/*
+ * Snapshots of the channel state of a score, taken every few ticks,
+ * so that the state at any time is found without walking through the
+ * score from its start.
+ */
+typedef struct {
+	unsigned long nsnap;	/* At least one, at time 0. */
+	ChaseSnap *snap;
+} ChaseTable;
+
+/*
+ * Build the snapshot table of `s'. The snapshots are spread evenly
+ * over the ticks of the score, a few thousand events apart. The
+ * tracks are walked through one after the other between snapshots and
+ * rewound.
+ * Returns NULL on errors.
+ */
+ChaseTable *chase_new(Score *s);
+
+/*
+ * Get the state of the channels of `s' before the events of tick `time'
+ * into `cs', starting from the last snapshot before.
+ * Returns 1 on success, else 0.
+ */
+int chase_state(const ChaseTable *c, Score *s, unsigned long time,
+    ChanState *cs);
+
+/*
+ * Store the events that restore the state `cs' at `e', which must have
+ * room for CHASEMAX events: for each channel, the controllers, the
+ * program and the pitch wheel. If `notesoff' is nonzero, each channel
+ * starts with a Reset All Controllers and an All Notes Off, so that
+ * values which are unset in `cs' return to their defaults as well.
+ * Controllers are sent in ascending order, so bank selects come before
+ * the program. Data entry and the (non-)registered parameter numbers
+ * are left out, as their values only make sense in the order they were
+ * sent.
+ * Returns the number of events.
+ */
+unsigned long chase_events(const ChanState *cs, int notesoff, MFEvent *e);
+
+/* Free a snapshot table. */
+void chase_free(ChaseTable *c);
+
+#endif /* __CHASE_H__ */
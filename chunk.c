@@ -9,6 +9,11 @@
 #include "chunk.h"
 #include "print.h"
 
+/* Get big-endian numbers from the buffer without bounds checks. */
+#define GET16(b)	((b)->cur += 2, (b)->cur[-2] << 8 | (b)->cur[-1])
+#define GET32(b)	((b)->cur += 4, (unsigned long)(b)->cur[-4] << 24 | \
+			 (b)->cur[-3] << 16 | (b)->cur[-2] << 8 | (b)->cur[-1])
+
 /* Supported chunk types. */
 const unsigned long MThd = 'M' << 24 | 'T' << 16 | 'h' << 8 | 'd';
 const unsigned long MTrk = 'M' << 24 | 'T' << 16 | 'r' << 8 | 'k';
@@ -22,18 +27,13 @@ const unsigned long MTrk = 'M' << 24 | 'T' << 16 | 'r' << 8 | 'k';
 static int tryMThd(MBUF *b, CHUNK *c) {
 	long size;
 	int fmt, ntrk, div;
-	unsigned long p = mbuf_pos(b);
+	unsigned long p = mbuf_tell(b);
 
-	if (!mbuf_request(b, 8) ||
-		mbuf_get(b) != 'M' ||
-		mbuf_get(b) != 'T' ||
-		mbuf_get(b) != 'h' ||
-		mbuf_get(b) != 'd') {
-		mbuf_set(b, p);
+	if (!mbuf_have(b, 8) || memcmp(b->cur, "MThd", 4))
 		return 0;
-	}
+	b->cur += 4;
 
-	size = mbuf_get(b) << 24 | mbuf_get(b) << 16 | mbuf_get(b) << 8 | mbuf_get(b);
+	size = GET32(b);
 
 	if (size < 6) {
 		midiprint(MPError, "skipping header: size too short");
@@ -42,17 +42,15 @@ static int tryMThd(MBUF *b, CHUNK *c) {
 	}
 	if (size > 6)
 		midiprint(MPWarn, "unusual long header: %ld bytes", size);
-	if (!mbuf_request(b, 6)) {
+	if (!mbuf_have(b, 6)) {
 		midiprint(MPError, "skipping header: truncated header at end of file");
 		mbuf_set(b, p);
 		return 0;
 	}
-	if (!mbuf_request(b, size))
-		midiprint(MPWarn, "truncated but usable header at end of file");
 
-	fmt = mbuf_get(b) << 8 | mbuf_get(b);
-	ntrk = mbuf_get(b) << 8 | mbuf_get(b);
-	div = mbuf_get(b) << 8 | mbuf_get(b);
+	fmt = GET16(b);
+	ntrk = GET16(b);
+	div = GET16(b);
 	if (fmt < 0 || fmt > 2) {
 		midiprint(MPError, "skipping header: illegal format %d", fmt);
 		mbuf_set(b, p);
@@ -69,6 +67,14 @@ static int tryMThd(MBUF *b, CHUNK *c) {
 		return 0;
 	}
 
+	/*
+	 * Skip the rest of a long header instead of requesting it, which
+	 * stream buffers can't hold if it is large.
+	 */
+	if (size > 6 && mbuf_set(b, mbuf_tell(b) + (size - 6)) !=
+	    p + 8 + size)
+		midiprint(MPWarn, "truncated but usable header at end of file");
+
 	c->type = MThd;
 	c->hdr.mthd.fmt = fmt;
 	c->hdr.mthd.ntrk = ntrk;
@@ -81,18 +87,12 @@ static int tryMThd(MBUF *b, CHUNK *c) {
 /* As above, but for tracks. */
 static int tryMTrk(MBUF *b, CHUNK *c) {
 	unsigned long size;
-	unsigned long p = mbuf_pos(b);
 
-	if (!mbuf_request(b, 8) ||
-		mbuf_get(b) != 'M' ||
-		mbuf_get(b) != 'T' ||
-		mbuf_get(b) != 'r' ||
-		mbuf_get(b) != 'k') {
-		mbuf_set(b, p);
+	if (!mbuf_have(b, 8) || memcmp(b->cur, "MTrk", 4))
 		return 0;
-	}
+	b->cur += 4;
 
-	size = mbuf_get(b) << 24 | mbuf_get(b) << 16 | mbuf_get(b) << 8 | mbuf_get(b);
+	size = GET32(b);
 
 	c->type = MTrk;
 	c->hdr.mtrk.size = size;
@@ -123,19 +123,19 @@ static int tryMTrk(MBUF *b, CHUNK *c) {
  * number of bytes skipped before the chunk (normally 0).
  */
 long search_chunk(MBUF *b, CHUNK *chunk) {
-	unsigned long p = mbuf_pos(b);
+	unsigned long p = mbuf_tell(b);
 	unsigned long i = 0;
 
 	/*
 	 * Search the header including all fields.
 	 * Corrupted headers are skipped after issuing a warning message.
 	 */
-	while (mbuf_request(b, 8) && !tryMThd(b, chunk) && !tryMTrk(b, chunk)) {
-		(void) mbuf_get(b);
+	while (mbuf_have(b, 8) && !tryMThd(b, chunk) && !tryMTrk(b, chunk)) {
+		(void) mbuf_getc(b);
 		i++;
 	}
 
-	if (!mbuf_request(b,1))
+	if (!mbuf_have(b,1))
 		return -1;
 
 	if (chunk->type == MThd || chunk->type == MTrk)
@@ -154,7 +154,6 @@ long search_chunk(MBUF *b, CHUNK *chunk) {
  */
 int write_MThd(MBUF *b, int fmt, int ntrk, int div) {
 	char hdr[14] = "MThd\0\0\0\6";
-	int i;
 
 	hdr[8] = (fmt >> 8) & 0xff;
 	hdr[9] = fmt & 0xff;
@@ -163,26 +162,17 @@ int write_MThd(MBUF *b, int fmt, int ntrk, int div) {
 	hdr[12] = (div >> 8) & 0xff;
 	hdr[13] = div & 0xff;
 
-	for (i = 0; i < 14; i++)
-		if (mbuf_put(b, hdr[i]) == EOF)
-			return 0;
-
-	return 1;
+	return !mbuf_write(b, hdr, sizeof(hdr));
 }
 
 /* Write a track chunk with the given size. */
 int write_MTrk(MBUF *b, long size) {
 	char hdr[8] = "MTrk";
-	int i;
 
 	hdr[4] = (size >> 24)  & 0xff;
 	hdr[5] = (size >> 16)  & 0xff;
 	hdr[6] = (size >> 8)  & 0xff;
 	hdr[7] = size  & 0xff;
 
-	for (i = 0; i < 8; i++)
-		if (mbuf_put(b, hdr[i]) == EOF)
-			return 0;
-
-	return 1;
+	return !mbuf_write(b, hdr, sizeof(hdr));
 }
@@ -0,0 +1,230 @@
+/* Decoding scores in a separate thread. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "arena.h"
+#include "decode.h"
+#include "score.h"
+
+/* Number of items in the ring. */
+#define RINGSIZE	4096
+
+/*
+ * Nanoseconds to sleep while the ring is full or empty. The consumer
+ * only waits if decoding falls behind, so it retries more often.
+ */
+#define PUTWAIT		1000000
+#define GETWAIT		100000
+
+/* Types of ring items. */
+enum { SCORE, EVENT, END, DONE };
+
+/* An item of the ring: the start of a score, an event or an end. */
+struct item {
+	int type;
+	int div;		/* Division of a score. */
+	unsigned long buf;	/* Buffer of a score. */
+	MFEvent e;		/* An event. */
+};
+
+/*
+ * Decoder state. The ring is only written by the decoder thread at
+ * `head' and only read by the consumer at `tail'; both count the items
+ * ever put or taken.
+ */
+struct _Decoder {
+	MBUF **b;
+	unsigned long nb;
+	void (*begin)(unsigned long);
+	Arena *arena;		/* Allocated data of the events. */
+	pthread_t thread;
+	atomic_ulong head;
+	atomic_ulong tail;
+	atomic_int quit;	/* Stop decoding. */
+	struct item ring[RINGSIZE];
+};
+
+/* Sleep for `nsec' nanoseconds. */
+static void nap(long nsec) {
+	struct timespec ts;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = nsec;
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * Put a copy of `it' into the ring, waiting for room.
+ * Returns 1 on success, or 0 if decoding is to stop.
+ */
+static int put(Decoder *d, const struct item *it) {
+	unsigned long head;
+
+	head = atomic_load_explicit(&d->head, memory_order_relaxed);
+	while (head - atomic_load_explicit(&d->tail, memory_order_acquire) ==
+	    RINGSIZE) {
+		if (atomic_load_explicit(&d->quit, memory_order_relaxed))
+			return 0;
+		nap(PUTWAIT);
+	}
+
+	d->ring[head % RINGSIZE] = *it;
+	atomic_store_explicit(&d->head, head + 1, memory_order_release);
+	return 1;
+}
+
+/* Get the next item of the ring without taking it, waiting for one. */
+static struct item *peek(Decoder *d) {
+	unsigned long tail;
+
+	tail = atomic_load_explicit(&d->tail, memory_order_relaxed);
+	while (atomic_load_explicit(&d->head, memory_order_acquire) == tail)
+		nap(GETWAIT);
+
+	return &d->ring[tail % RINGSIZE];
+}
+
+/* Take the item returned by `peek' out of the ring. */
+static void take(Decoder *d) {
+	atomic_fetch_add_explicit(&d->tail, 1, memory_order_release);
+}
+
+/* The decoder thread. */
+static void *decode(void *arg) {
+	Decoder *d = arg;
+	ScoreReader *r;
+	struct item it;
+	MFEvent *e;
+	int ok = 1;
+
+	for (it.buf = 0; ok && it.buf < d->nb; it.buf++) {
+		if (d->begin)
+			d->begin(it.buf);
+
+		while (ok && (r = score_reader_new(d->b[it.buf], d->arena,
+		    &it.div))) {
+			it.type = SCORE;
+			ok = put(d, &it);
+
+			it.type = EVENT;
+			while (ok && (e = score_reader_step(r, NULL))) {
+				it.e = *e;
+				ok = put(d, &it);
+			}
+
+			it.type = END;
+			ok = ok && put(d, &it);
+
+			score_reader_free(r);
+		}
+	}
+
+	it.type = DONE;
+	if (ok)
+		(void) put(d, &it);
+
+	return NULL;
+}
+
+/*
+ * Start decoding the scores in the `n' stable buffers at `b' (see
+ * `mbuf_stable' and `score_reader_new') one after the other, so that
+ * they can be played without a gap. The buffers must not be used until
+ * the decoder is freed. If `begin' is not NULL, it is called in the
+ * decoder thread with the index of each buffer before decoding it.
+ * Returns NULL on errors.
+ */
+Decoder *decoder_start(MBUF **b, unsigned long n,
+    void (*begin)(unsigned long)) {
+	unsigned long i;
+	Decoder *d;
+	int r;
+
+	for (i = 0; i < n; i++)
+		if (!mbuf_stable(b[i])) {
+			errno = EINVAL;
+			return NULL;
+		}
+
+	if (!(d = malloc(sizeof(*d))))
+		return NULL;
+
+	if (!(d->arena = arena_new())) {
+		free(d);
+		return NULL;
+	}
+
+	d->b = b;
+	d->nb = n;
+	d->begin = begin;
+	atomic_init(&d->head, 0);
+	atomic_init(&d->tail, 0);
+	atomic_init(&d->quit, 0);
+
+	if ((r = pthread_create(&d->thread, NULL, decode, d)) != 0) {
+		arena_free(d->arena);
+		free(d);
+		errno = r;
+		return NULL;
+	}
+
+	return d;
+}
+
+/*
+ * Skip to the start of the next score and store its division at `div'
+ * and the index of its buffer at `buf'. Waits for the decoder if
+ * necessary.
+ * Returns 1 if there is another score, else 0.
+ */
+int decoder_score(Decoder *d, int *div, unsigned long *buf) {
+	struct item *it;
+
+	while ((it = peek(d))->type != DONE) {
+		if (it->type == SCORE) {
+			*div = it->div;
+			*buf = it->buf;
+			take(d);
+			return 1;
+		}
+		take(d);
+	}
+
+	return 0;
+}
+
+/*
+ * Copy the next event of the current score to `e'. Waits for the
+ * decoder if necessary.
+ * Returns 1 on success, or 0 at the end of the score.
+ */
+int decoder_step(Decoder *d, MFEvent *e) {
+	struct item *it = peek(d);
+
+	if (it->type == EVENT) {
+		*e = it->e;
+		take(d);
+		return 1;
+	}
+
+	if (it->type == END)
+		take(d);
+	return 0;
+}
+
+/*
+ * Stop decoding and free the decoder and the data of all events
+ * passed. Each buffer is positioned after the last score decoded.
+ */
+void decoder_free(Decoder *d) {
+	if (d) {
+		atomic_store(&d->quit, 1);
+		pthread_join(d->thread, NULL);
+		arena_free(d->arena);
+		free(d);
+	}
+}
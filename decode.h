@@ -0,0 +1,49 @@
+/* Decoding scores in a separate thread. */
+
+#ifndef __DECODE_H__
+#define __DECODE_H__
+
+#include "buffer.h"
+#include "event.h"
+
+/*
+ * A decoder reads the scores of a list of buffers in a thread of its
+ * own and passes their events in time order through a lock-free ring
+ * to a single consumer. Playing can thus start as soon as the first
+ * events are decoded, and the consumer never waits for a lock.
+ */
+typedef struct _Decoder Decoder;
+
+/*
+ * Start decoding the scores in the `n' stable buffers at `b' (see
+ * `mbuf_stable' and `score_reader_new') one after the other, so that
+ * they can be played without a gap. The buffers must not be used until
+ * the decoder is freed. If `begin' is not NULL, it is called in the
+ * decoder thread with the index of each buffer before decoding it.
+ * Returns NULL on errors.
+ */
+Decoder *decoder_start(MBUF **b, unsigned long n,
+    void (*begin)(unsigned long));
+
+/*
+ * Skip to the start of the next score and store its division at `div'
+ * and the index of its buffer at `buf'. Waits for the decoder if
+ * necessary.
+ * Returns 1 if there is another score, else 0.
+ */
+int decoder_score(Decoder *d, int *div, unsigned long *buf);
+
+/*
+ * Copy the next event of the current score to `e'. Waits for the
+ * decoder if necessary.
+ * Returns 1 on success, or 0 at the end of the score.
+ */
+int decoder_step(Decoder *d, MFEvent *e);
+
+/*
+ * Stop decoding and free the decoder and the data of all events
+ * passed. Each buffer is positioned after the last score decoded.
+ */
+void decoder_free(Decoder *d);
+
+#endif /* __DECODE_H__ */
@@ -10,6 +10,9 @@
 #include "print.h"
 #include "vld.h"
 
+/* Largest time that fits into a sort key. */
+#define MAXKEYTIME	(((uint64_t)1 << 56) - 1)
+
 /*
  * This converts a general meta message into a specific message, if
  * possible. If conversion into a fixed size message is possible, the
@@ -18,9 +21,10 @@
  * else it returns 1.
  */
 static int convert_meta(MFMessage *msg) {
-	struct vld *vld = msg->meta.data;
-	long length = vld->length;
-	const unsigned char *data = vld->data;
+	struct vld vld = msg->meta.data;
+	long length = vld.length;
+	const unsigned char *data = vld.data;
+	int keep = 0;
 	int result = 0;
 
 	switch (msg->cmd) {
@@ -41,8 +45,7 @@ static int convert_meta(MFMessage *msg) {
 	case LYRIC:
 	case MARKER:
 	case CUEPOINT:
-		msg->text.text = vld;
-		vld = NULL;
+		keep = 1;
 		result = 1;
 		break;
 	case CHANNELPREFIX:
@@ -113,25 +116,26 @@ static int convert_meta(MFMessage *msg) {
 		result = 1;
 		break;
 	case SEQUENCERSPECIFIC:
-		msg->sequencerspecific.data = vld; vld = NULL;
+		keep = 1;
 		result = 1;
 		break;
 	default:
 		midiprint(MPWarn, "unknown meta type %hd", msg->cmd);
-		vld = NULL;
+		keep = 1;
 		result = 1;
 		break;
 	}
 
-	if (vld)
-		free(vld);
+	if (!keep)
+		vld_clear(&vld);
 
 	return result;
 }
 
 /*
  * Get the next message from the buffer and store it at `msg'. For variable
- * sized messages, the necessary memory is automatically allocated.
+ * sized messages, the necessary memory is automatically allocated, unless
+ * the data is borrowed from the buffer (see `vld_borrow').
  * `rs' points to a location that contains the current channel voice
  * status byte and is used to support running status. It is updated if
  * necessary. To reset running status, set `*rs' to 0 before calling
@@ -139,17 +143,17 @@ static int convert_meta(MFMessage *msg) {
  * If something goes wrong, return 0, else 1.
  */
 int read_message(MBUF *b, MFMessage *msg, unsigned char *rs) {
-	long i = mbuf_pos(b);
+	long i = mbuf_tell(b);
 	unsigned char b1, b2;
 
-	if (!mbuf_request(b, 1)) {
+	if (!mbuf_have(b, 1)) {
 		midiprint(MPError, "reading message: end of input");
 		return 0;
 	}
-	if (!((msg->cmd = mbuf_get(b)) & 0x80)) {
-		mbuf_set(b, i);
+	if ((msg->cmd = mbuf_peekc(b)) & 0x80)
+		b->cur++;
+	else
 		msg->cmd = *rs;
-	}
 	if (!(msg->cmd & 0x80)) {
 		midiprint(MPError, "reading message: got data byte %hd", msg->cmd);
 		mbuf_set(b, i);
@@ -163,17 +167,17 @@ int read_message(MBUF *b, MFMessage *msg, unsigned char *rs) {
 		case NOTEOFF:
 		case KEYPRESSURE:
 		case CONTROLCHANGE:
-			if (!mbuf_request(b, 2)) {
+			if (!mbuf_have(b, 2)) {
 				midiprint(MPError, "reading message: end of input");
 				mbuf_set(b, i);
 				return 0;
 			}
-			if ((b1 = mbuf_get(b)) & 0x80) {
+			if ((b1 = mbuf_getc(b)) & 0x80) {
 				midiprint(MPError, "reading message: got status byte %hu", b1);
 				mbuf_set(b, i);
 				return 0;
 			}
-			if ((b2 = mbuf_get(b)) & 0x80) {
+			if ((b2 = mbuf_getc(b)) & 0x80) {
 				midiprint(MPError, "reading message: got status byte %hu", b2);
 				mbuf_set(b, i);
 				return 0;
@@ -186,12 +190,12 @@ int read_message(MBUF *b, MFMessage *msg, unsigned char *rs) {
 		/* One-byte messages. */
 		case PROGRAMCHANGE:
 		case CHANNELPRESSURE:
-			if (!mbuf_request(b, 1)) {
+			if (!mbuf_have(b, 1)) {
 				midiprint(MPError, "reading message: end of input");
 				mbuf_set(b, i);
 				return 0;
 			}
-			if ((b1 = mbuf_get(b)) & 0x80) {
+			if ((b1 = mbuf_getc(b)) & 0x80) {
 				midiprint(MPError, "reading message: got status byte %hu", b1);
 				mbuf_set(b, i);
 				return 0;
@@ -202,17 +206,17 @@ int read_message(MBUF *b, MFMessage *msg, unsigned char *rs) {
 			break;
 		/* This is special since it contains a 2x7bit quantity: */
 		case PITCHWHEELCHANGE:
-			if (!mbuf_request(b, 2)) {
+			if (!mbuf_have(b, 2)) {
 				midiprint(MPError, "reading message: end of input");
 				mbuf_set(b, i);
 				return 0;
 			}
-			if ((b1 = mbuf_get(b)) & 0x80) {
+			if ((b1 = mbuf_getc(b)) & 0x80) {
 				midiprint(MPError, "reading message: got status byte %hu", b1);
 				mbuf_set(b, i);
 				return 0;
 			}
-			if ((b2 = mbuf_get(b)) & 0x80) {
+			if ((b2 = mbuf_getc(b)) & 0x80) {
 				midiprint(MPError, "reading message: got status byte %hu", b2);
 				mbuf_set(b, i);
 				return 0;
@@ -230,7 +234,7 @@ int read_message(MBUF *b, MFMessage *msg, unsigned char *rs) {
 	/* Sysex messages. */
 	case SYSTEMEXCLUSIVE:
 	case SYSTEMEXCLUSIVECONT:
-		if (!(msg->systemexclusive.data = read_vld(b))) {
+		if (!read_vld(b, &msg->systemexclusive.data)) {
 			mbuf_set(b, i);
 			return 0;
 		}
@@ -241,19 +245,18 @@ int read_message(MBUF *b, MFMessage *msg, unsigned char *rs) {
 		 * Get the type. There must be at least two bytes; one for the
 		 * type and one for the size.
 		 */
-		if (!mbuf_request(b, 2)) {
+		if (!mbuf_have(b, 2)) {
 			midiprint(MPError, "reading message: end of input");
 			mbuf_set(b, i);
 			return 0;
 		}
-		msg->cmd = mbuf_get(b);
+		msg->cmd = mbuf_getc(b);
 		/* Get the data. */
-		if (!(msg->meta.data = read_vld(b))) {
+		if (!read_vld(b, &msg->meta.data)) {
 			mbuf_set(b, i);
 			return 0;
 		}
 		if (!convert_meta(msg)) {
-			free(msg->meta.data);
 			mbuf_set(b, i);
 			return 0;
 		}
@@ -291,10 +294,10 @@ int write_message(MBUF *b, MFMessage *msg, unsigned char *rs) {
 		switch (cmd) {
 		case SYSTEMEXCLUSIVE:
 		case SYSTEMEXCLUSIVECONT:
-			return write_vld(b, msg->systemexclusive.data);
+			return write_vld(b, &msg->systemexclusive.data);
 		case META:
 			return mbuf_put(b, msg->cmd) != EOF &&
-				write_vld(b, msg->meta.data);
+				write_vld(b, &msg->meta.data);
 		}
 	} else if (cmd >= 0x80) {
 		/* This is a channel voice message. */
@@ -348,7 +351,7 @@ int write_message(MBUF *b, MFMessage *msg, unsigned char *rs) {
 		case LYRIC:
 		case MARKER:
 		case CUEPOINT:
-			return write_vld(b, msg->text.text);
+			return write_vld(b, &msg->text.text);
 		case CHANNELPREFIX:
 			return write_vlq(b, 1) &&
 				mbuf_put(b, msg->channelprefix.channel) != EOF;
@@ -381,7 +384,7 @@ int write_message(MBUF *b, MFMessage *msg, unsigned char *rs) {
 				mbuf_put(b, msg->keysignature.sharpsflats) != EOF &&
 				mbuf_put(b, msg->keysignature.minor) != EOF;
 		case SEQUENCERSPECIFIC:
-			return write_vld(b, msg->sequencerspecific.data);
+			return write_vld(b, &msg->sequencerspecific.data);
 		}
 	}
 
@@ -393,58 +396,104 @@ int write_message(MBUF *b, MFMessage *msg, unsigned char *rs) {
 	return 0;
 }
 
-/*
- * To simplify cleanup, this function frees allocated data if `msg' is a
- * variable sized message.
- */
-void clear_message(MFMessage *msg) {
+/* Returns the variable length data of `msg', or NULL if there is none. */
+struct vld *message_data(MFMessage *msg) {
 	switch (msg->cmd) {
 	case SYSTEMEXCLUSIVE:
-		free(msg->systemexclusive.data);
-		break;
+		return &msg->systemexclusive.data;
 	case SYSTEMEXCLUSIVECONT:
-		free(msg->systemexclusivecont.data);
-		break;
+		return &msg->systemexclusivecont.data;
 	case META:
-		free(msg->meta.data);
-		break;
+		return &msg->meta.data;
 	case TEXT:
-		free(msg->text.text);
-		break;
+		return &msg->text.text;
 	case COPYRIGHTNOTICE:
-		free(msg->copyrightnotice.text);
-		break;
+		return &msg->copyrightnotice.text;
 	case TRACKNAME:
-		free(msg->trackname.text);
-		break;
+		return &msg->trackname.text;
 	case INSTRUMENTNAME:
-		free(msg->instrumentname.text);
-		break;
+		return &msg->instrumentname.text;
 	case LYRIC:
-		free(msg->lyric.text);
-		break;
+		return &msg->lyric.text;
 	case MARKER:
-		free(msg->marker.text);
-		break;
+		return &msg->marker.text;
 	case CUEPOINT:
-		free(msg->cuepoint.text);
-		break;
+		return &msg->cuepoint.text;
 	case SEQUENCERSPECIFIC:
-		free(msg->sequencerspecific.data);
-		break;
+		return &msg->sequencerspecific.data;
 	}
+	return NULL;
+}
+
+/*
+ * To simplify cleanup, this function frees allocated data if `msg' is a
+ * variable sized message.
+ */
+void clear_message(MFMessage *msg) {
+	struct vld *vld;
+
+	if ((vld = message_data(msg)))
+		vld_clear(vld);
 	msg->cmd = EMPTY;
 }
 
+/*
+ * Get the sort key of an event. Events are ordered by time and, for
+ * equal-timed events, as follows:
+ *   Any event           < End of track
+ *   Other event         < Voice event
+ *   Voice event ch=x    < Voice event ch=y, if x < y
+ *   Program change      < Other voice event
+ *   Control change      < Other voice event
+ *   Note off            < Other voice event
+ * Events with equal keys are meant to keep their order.
+ * The time is packed into the upper 56 bits of the key, so larger times
+ * compare equal.
+ */
+uint64_t event_key(const MFEvent *e) {
+	unsigned char cmd = e->msg.cmd;
+	uint64_t time;
+	int class;
+
+	if (cmd == ENDOFTRACK)
+		class = 0xff;
+	else if (cmd < NOTEOFF || cmd >= SYSTEMEXCLUSIVE)
+		class = 0;
+	else {
+		switch (cmd & 0xf0) {
+		case PROGRAMCHANGE:
+			class = 0;
+			break;
+		case CONTROLCHANGE:
+			class = 1;
+			break;
+		case NOTEON:
+			class = e->msg.noteon.velocity ? 3 : 2;
+			break;
+		case NOTEOFF:
+			class = 2;
+			break;
+		default:
+			class = 3;
+			break;
+		}
+		class += 1 + CHN(e->msg) * 4;
+	}
+
+	time = e->time < MAXKEYTIME ? e->time : MAXKEYTIME;
+	return time << 8 | class;
+}
+
 /*
  * Get the next event, i.e. the next (delta) time and message.
  * Parameters and return value are the same as of `read_message'.
  */
 int read_event(MBUF *b, MFEvent *ev, unsigned char *rs) {
-	long pos = mbuf_pos(b);
+	long pos = mbuf_tell(b);
 
 	if ((ev->time = read_vlq(b)) < 0 || !read_message(b, &ev->msg, rs)) {
-		mbuf_set(b, pos);
+		if (mbuf_set(b, pos) == MBUF_LOST)
+			midiprint(MPError, "can't go back to pos %lx", pos);
 		return 0;
 	} else
 		return 1;
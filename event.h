@@ -5,7 +5,10 @@
 #ifndef __EVENT_H__
 #define __EVENT_H__
 
+#include <stdint.h>
+
 #include "buffer.h"
+#include "vld.h"
 
 /*
  * Midifile message types.
@@ -98,18 +101,18 @@ typedef struct {
 
 /*
  * For sysex messages, the data is stored elsewhere. The structure itself
- * only contains a pointer to the data field.
+ * only contains the length and a pointer to the data (see vld.h).
  */
 typedef struct {
-	struct vld *data;
+	struct vld data;
 } MFSystemExclusive;
 
 typedef struct {
-	struct vld *data;
+	struct vld data;
 } MFSystemExclusiveCont;
 
 typedef struct {
-	struct vld *data;
+	struct vld data;
 } MFMeta;
 
 /*
@@ -126,31 +129,31 @@ typedef struct {
 } MFSequenceNumber;
 
 typedef struct {
-	struct vld *text;
+	struct vld text;
 } MFText;
 
 typedef struct {
-	struct vld *text;
+	struct vld text;
 } MFCopyrightNotice;
 
 typedef struct {
-	struct vld *text;
+	struct vld text;
 } MFTrackName;
 
 typedef struct {
-	struct vld *text;
+	struct vld text;
 } MFInstrumentName;
 
 typedef struct {
-	struct vld *text;
+	struct vld text;
 } MFLyric;
 
 typedef struct {
-	struct vld *text;
+	struct vld text;
 } MFMarker;
 
 typedef struct {
-	struct vld *text;
+	struct vld text;
 } MFCuePoint;
 
 typedef struct {
@@ -181,7 +184,7 @@ typedef struct {
 } MFKeySignature;
 
 typedef struct {
-	struct vld *data;
+	struct vld data;
 } MFSequencerSpecific;
 
 /*
@@ -220,7 +223,8 @@ typedef struct {
 
 /*
  * Get the next message from the buffer and store it at `msg'. For variable
- * sized messages, the necessary memory is automatically allocated.
+ * sized messages, the necessary memory is automatically allocated, unless
+ * the data is borrowed from the buffer (see `vld_borrow').
  * `rs' points to a location that contains the current channel voice
  * status byte and is used to support running status. It is updated if
  * necessary. To reset running status, set `*rs' to 0 before calling
@@ -237,6 +241,9 @@ int read_message(MBUF *b, MFMessage *msg, unsigned char *rs);
  */
 int write_message(MBUF *b, MFMessage *msg, unsigned char *rs);
 
+/* Returns the variable length data of `msg', or NULL if there is none. */
+struct vld *message_data(MFMessage *msg);
+
 /*
  * To simplify cleanup, this function frees allocated data if `msg' is a
  * variable sized message.
@@ -252,6 +259,21 @@ typedef struct {
 	MFMessage msg;
 } MFEvent;
 
+/*
+ * Get the sort key of an event. Events are ordered by time and, for
+ * equal-timed events, as follows:
+ *   Any event           < End of track
+ *   Other event         < Voice event
+ *   Voice event ch=x    < Voice event ch=y, if x < y
+ *   Program change      < Other voice event
+ *   Control change      < Other voice event
+ *   Note off            < Other voice event
+ * Events with equal keys are meant to keep their order.
+ * The time is packed into the upper 56 bits of the key, so larger times
+ * compare equal.
+ */
+uint64_t event_key(const MFEvent *e);
+
 /*
  * Get the next event, i.e. the next (delta) time and message.
  * Parameters and return value are the same as of `read_message'.
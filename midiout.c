@@ -0,0 +1,185 @@
+/* Midi output devices. */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <sndio.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "midiout.h"
+
+/* The output structure, with the write and close functions of its type. */
+struct _MidiOut {
+	int (*write)(MidiOut *o, const void *buf, size_t n);
+	void (*close)(MidiOut *o);
+	struct mio_hdl *hdl;	/* sndio */
+	FILE *f;		/* file, raw */
+	struct timespec start;	/* file */
+	unsigned long writes;	/* # of writes, ... */
+	unsigned long bytes;	/* ... and of bytes written. */
+};
+
+/*
+ * The sndio functions, resolved at runtime so that only playing needs
+ * the library.
+ */
+static struct mio_hdl *(*p_mio_open)(const char *, unsigned int, int);
+static size_t (*p_mio_write)(struct mio_hdl *, const void *, size_t);
+static void (*p_mio_close)(struct mio_hdl *);
+
+/*
+ * Load libsndio and resolve the functions used.
+ * Returns 0 on success, else -1.
+ */
+static int loadsndio(void) {
+	static const char *names[] = {
+		"libsndio.so", "libsndio.so.7", NULL
+	};
+	static void *lib = NULL;
+	const char **name;
+
+	for (name = names; !lib && *name; name++)
+		lib = dlopen(*name, RTLD_NOW | RTLD_LOCAL);
+	if (!lib)
+		return -1;
+
+	p_mio_open = dlsym(lib, "mio_open");
+	p_mio_write = dlsym(lib, "mio_write");
+	p_mio_close = dlsym(lib, "mio_close");
+
+	return p_mio_open && p_mio_write && p_mio_close ? 0 : -1;
+}
+
+static int sndio_write(MidiOut *o, const void *buf, size_t n) {
+	return p_mio_write(o->hdl, buf, n) == n ? 0 : -1;
+}
+
+static void sndio_close(MidiOut *o) {
+	p_mio_close(o->hdl);
+}
+
+static int file_write(MidiOut *o, const void *buf, size_t n) {
+	const unsigned char *p = buf;
+	struct timespec now;
+	uint64_t usec;
+	size_t i;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		return -1;
+	usec = (uint64_t)(now.tv_sec - o->start.tv_sec) * 1000000 +
+	    (now.tv_nsec - o->start.tv_nsec) / 1000;
+
+	fprintf(o->f, "%llu", (unsigned long long)usec);
+	for (i = 0; i < n; i++)
+		fprintf(o->f, " %02x", p[i]);
+	return putc('\n', o->f) == EOF ? -1 : 0;
+}
+
+static int raw_write(MidiOut *o, const void *buf, size_t n) {
+	/* Devices and fifos want the bytes right away. */
+	if (fwrite(buf, 1, n, o->f) != n || fflush(o->f))
+		return -1;
+	return 0;
+}
+
+static void file_close(MidiOut *o) {
+	fclose(o->f);
+}
+
+static int mem_write(MidiOut *o, const void *buf, size_t n) {
+	(void) o;
+	(void) buf;
+	(void) n;
+	return 0;
+}
+
+static void mem_close(MidiOut *o) {
+	(void) o;
+}
+
+/*
+ * Open the midi output described by `spec', which is one of:
+ *   NULL, "sndio" or "sndio:port"
+ *           a sndio midi port, by default the default port; libsndio
+ *           is only loaded when such an output is opened
+ *   "file:path"
+ *           a file that gets one line per write, containing the time in
+ *           microseconds since opening and the bytes in hex
+ *   "raw:path"
+ *           a file, fifo or device that gets the bytes as they are
+ *   "mem"   nowhere, the bytes are only counted (see `midiout_count'),
+ *           so that playing can be measured without any I/O
+ * Returns NULL on errors.
+ */
+MidiOut *midiout_open(const char *spec) {
+	MidiOut *o;
+
+	if (!(o = calloc(1, sizeof(*o))))
+		return NULL;
+
+	if (!spec || !strcmp(spec, "sndio") || !strncmp(spec, "sndio:", 6)) {
+		if (loadsndio() || !(o->hdl = p_mio_open(spec && spec[5] ?
+		    spec + 6 : MIO_PORTANY, MIO_OUT, 0))) {
+			free(o);
+			return NULL;
+		}
+		o->write = sndio_write;
+		o->close = sndio_close;
+	} else if (!strncmp(spec, "file:", 5)) {
+		if (!(o->f = fopen(spec + 5, "w")) ||
+		    clock_gettime(CLOCK_MONOTONIC, &o->start)) {
+			if (o->f)
+				fclose(o->f);
+			free(o);
+			return NULL;
+		}
+		o->write = file_write;
+		o->close = file_close;
+	} else if (!strncmp(spec, "raw:", 4)) {
+		if (!(o->f = fopen(spec + 4, "w"))) {
+			free(o);
+			return NULL;
+		}
+		o->write = raw_write;
+		o->close = file_close;
+	} else if (!strcmp(spec, "mem")) {
+		o->write = mem_write;
+		o->close = mem_close;
+	} else {
+		errno = EINVAL;
+		free(o);
+		return NULL;
+	}
+
+	return o;
+}
+
+/*
+ * Write the `n' bytes at `buf' to the output.
+ * Returns 0 on success, else -1.
+ */
+int midiout_write(MidiOut *o, const void *buf, size_t n) {
+	o->writes++;
+	o->bytes += n;
+	return o->write(o, buf, n);
+}
+
+/*
+ * Get the number of writes to the output so far, and the number of
+ * bytes written into `*bytes'.
+ */
+unsigned long midiout_count(MidiOut *o, unsigned long *bytes) {
+	*bytes = o->bytes;
+	return o->writes;
+}
+
+/* Close the output. */
+void midiout_close(MidiOut *o) {
+	if (o) {
+		o->close(o);
+		free(o);
+	}
+}
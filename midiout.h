@@ -0,0 +1,41 @@
+/* Midi output devices. */
+
+#ifndef __MIDIOUT_H__
+#define __MIDIOUT_H__
+
+#include <stddef.h>
+
+typedef struct _MidiOut MidiOut;
+
+/*
+ * Open the midi output described by `spec', which is one of:
+ *   NULL, "sndio" or "sndio:port"
+ *           a sndio midi port, by default the default port; libsndio
+ *           is only loaded when such an output is opened
+ *   "file:path"
+ *           a file that gets one line per write, containing the time in
+ *           microseconds since opening and the bytes in hex
+ *   "raw:path"
+ *           a file, fifo or device that gets the bytes as they are
+ *   "mem"   nowhere, the bytes are only counted (see `midiout_count'),
+ *           so that playing can be measured without any I/O
+ * Returns NULL on errors.
+ */
+MidiOut *midiout_open(const char *spec);
+
+/*
+ * Write the `n' bytes at `buf' to the output.
+ * Returns 0 on success, else -1.
+ */
+int midiout_write(MidiOut *o, const void *buf, size_t n);
+
+/*
+ * Get the number of writes to the output so far, and the number of
+ * bytes written into `*bytes'.
+ */
+unsigned long midiout_count(MidiOut *o, unsigned long *bytes);
+
+/* Close the output. */
+void midiout_close(MidiOut *o);
+
+#endif /* __MIDIOUT_H__ */
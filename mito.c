@@ -1,27 +1,31 @@
 /* mito --- the midi tool */
-/* XXX: the order of events (when using -e) is not deterministic! */
 
-#include <assert.h>
 #include <err.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <signal.h>
-#include <sndio.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 #include <unistd.h>
 #include <vis.h>
 
 #include "chunk.h"
+#include "decode.h"
 #include "event.h"
+#include "midiout.h"
+#include "play.h"
 #include "print.h"
 #include "score.h"
+#include "tempo.h"
 #include "util.h"
 #include "vld.h"
 
 static void usage(void) {
-	fputs("usage: mito [-hleuqtnm012c] [-o file] [-d div] {[file][@sl]}...\n"
+	fputs("usage: mito [-hleuqtnmzS012c] [-o file] [-d div] [-M spec]\n"
+	    "            [-T file] [-s pos] [-L pos-pos] {[file][@sl]}...\n"
 	    "overall options:\n"
 	    "    -h:  show score headers\n"
 	    "    -l:  show track lengths\n"
@@ -31,7 +35,22 @@ static void usage(void) {
 	    "    -o:  write resulting output to `file'\n"
 	    "    -t:  print events in real time\n"
 	    "    -p:  play events to default midi device\n"
-	    "         (implies -u, -m, and -t)\n"
+	    "         (implies -u and -t); files follow each other\n"
+	    "         without gaps\n"
+	    "    -M:  play events to midi output `spec' (implies -p):\n"
+	    "         sndio[:port], file:path, raw:path or mem\n"
+	    "    -T:  play on a virtual clock that skips all waits and log\n"
+	    "         the scheduled and actual time of each midi write to\n"
+	    "         `file' instead (implies -p)\n"
+	    "    -z:  play noteoff events as noteon events with velocity 0\n"
+	    "    -S:  show timing statistics of -t and -p on exit and\n"
+	    "         on SIGINFO or SIGUSR1\n"
+	    "    -s:  start -t and -p at `pos' with the state of the\n"
+	    "         midi channels at that time: ticks (1920), seconds\n"
+	    "         (12.5s) or bar:beat from 1:1 (17:3)\n"
+	    "    -L:  repeat the range from the first `pos' up to the\n"
+	    "         second one; playing starts at the first unless -s\n"
+	    "         is given\n"
 	    "input:\n"
 	    "    -m: merge all tracks of each single score\n"
 	    "    -f: fix nested / unmatched noteon/noteoff groups\n"
@@ -55,18 +74,57 @@ static int f_concattracks = 0;
 static int f_fixgroups = 0;
 static int f_ungroup = 0;
 static int f_timed = 0;
+static int f_stats = 0;
+static int f_zeronoteoff = 0;
 
-/* The filename to print in warning and error messages. */
-static char *warnname = NULL;
+/* Positions to start playing at and to repeat, see `position'. */
+static const char *startpos = NULL;
+static char loopfrom[64] = "";
+static char loopto[64] = "";
+
+/* Latest position in seconds, so that converting it can't overflow. */
+#define MAXSECONDS	1e7
+
+/* Midi output to play to, see `midiout_open'; opened once for all. */
+static const char *outspec = NULL;
+static MidiOut *midiout = NULL;
+
+/*
+ * The filename to print in warning and error messages. The decoder
+ * thread has its own, as it reads ahead of the file played.
+ */
+static _Thread_local char *warnname = NULL;
+
+/* A file queued for playing, see `queuefile'. */
+struct qfile {
+	MBUF *b;
+	char *name;
+	int nscores;		/* # of scores played. */
+};
+
+static struct qfile *queue = NULL;
+static unsigned long nqueue = 0;
 
 static int quiet = 0;
-static int error = 0;
+
+/* Set by fatal errors, also of the decoder thread. */
+static atomic_int error = 0;
 
 static int outformat = -1;
 static int outdiv = 0;
 static int outntrk = 0;
 
 static volatile sig_atomic_t stop = 0;
+static volatile sig_atomic_t report = 0;
+
+/* Timing statistics of all scores played. */
+static PlayStats stats;
+
+/* Log of the midi writes on the virtual clock, see `-T'. */
+static FILE *tlog = NULL;
+
+/* Running status of the midi output. */
+static unsigned char running = 0;
 
 /* If not NULL, write track data to this buffer. */
 static MBUF *outb = NULL;
@@ -104,7 +162,7 @@ static void print(MPLevel level, const char *fmt, va_list args) {
 }
 
 /* Convert a vld into a printable string. */
-static char *strdat(struct vld *vld) {
+static char *strdat(const struct vld *vld) {
 	static char buf[1024 * 4 + 1];
 	long length = vld->length;
 	int trunc = length > 1024;
@@ -171,15 +229,15 @@ static void printevent(MFEvent *e) {
 	switch (e->msg.cmd) {
 	case SYSTEMEXCLUSIVE:
 		midiprint(MPNote, "%8ld SystemExclusive `%s'", t,
-		    strdat(e->msg.systemexclusive.data));
+		    strdat(&e->msg.systemexclusive.data));
 		return;
 	case SYSTEMEXCLUSIVECONT:
 		midiprint(MPNote, "%8ld SystemExclusiveCont `%s'", t,
-		    strdat(e->msg.systemexclusivecont.data));
+		    strdat(&e->msg.systemexclusivecont.data));
 		return;
 	case META:
 		midiprint(MPNote, "%8ld Meta %hd `%s'", t,
-		    e->msg.cmd, strdat(e->msg.meta.data));
+		    e->msg.cmd, strdat(&e->msg.meta.data));
 		return;
 	case SEQUENCENUMBER:
 		midiprint(MPNote, "%8ld SequenceNumber %hu", t,
@@ -187,31 +245,31 @@ static void printevent(MFEvent *e) {
 		return;
 	case TEXT:
 		midiprint(MPNote, "%8ld Text `%s'", t,
-		    strdat(e->msg.text.text));
+		    strdat(&e->msg.text.text));
 		return;
 	case COPYRIGHTNOTICE:
 		midiprint(MPNote, "%8ld CopyrightNotice `%s'", t,
-		    strdat(e->msg.copyrightnotice.text));
+		    strdat(&e->msg.copyrightnotice.text));
 		return;
 	case TRACKNAME:
 		midiprint(MPNote, "%8ld TrackName `%s'", t,
-		    strdat(e->msg.trackname.text));
+		    strdat(&e->msg.trackname.text));
 		return;
 	case INSTRUMENTNAME:
 		midiprint(MPNote, "%8ld InstrumentName `%s'", t,
-		    strdat(e->msg.instrumentname.text));
+		    strdat(&e->msg.instrumentname.text));
 		return;
 	case LYRIC:
 		midiprint(MPNote, "%8ld Lyric `%s'", t,
-		    strdat(e->msg.lyric.text));
+		    strdat(&e->msg.lyric.text));
 		return;
 	case MARKER:
 		midiprint(MPNote, "%8ld Marker `%s'", t,
-		    strdat(e->msg.marker.text));
+		    strdat(&e->msg.marker.text));
 		return;
 	case CUEPOINT:
 		midiprint(MPNote, "%8ld CuePoint `%s'", t,
-		    strdat(e->msg.cuepoint.text));
+		    strdat(&e->msg.cuepoint.text));
 		return;
 	case CHANNELPREFIX:
 		midiprint(MPNote, "%8ld ChannelPrefix %hd", t,
@@ -251,64 +309,186 @@ static void printevent(MFEvent *e) {
 		return;
 	case SEQUENCERSPECIFIC:
 		midiprint(MPNote, "%8ld SequencerSpecific `%s'", t,
-		    strdat(e->msg.sequencerspecific.data));
+		    strdat(&e->msg.sequencerspecific.data));
 		return;
 	}
 
 	midiprint(MPNote, "%8ld Unknown %hu", t, e->msg.cmd);
 }
 
-static void playevent(struct mio_hdl *hdl, MFEvent *e) {
-	unsigned char buf[4];
+/*
+ * Encode the channel voice event `e' as midi message at `buf', which
+ * must have room for 3 bytes. The status byte is left out if it equals
+ * the running status of the output; with `-z', NoteOff events are sent
+ * as NoteOn events with velocity zero to keep the running status.
+ * Returns the size of the message, or 0 for other events.
+ */
+static size_t encodeevent(MFEvent *e, unsigned char *buf) {
+	unsigned char cmd = e->msg.cmd, data[2];
 	size_t n = 0;
-	buf[n++] = e->msg.cmd;
+
 	/* No SysEx for now. */
-	switch (e->msg.cmd & 0xf0) {
+	switch (cmd & 0xf0) {
 	case PROGRAMCHANGE:
-		buf[n++] = e->msg.programchange.program;
+		data[n++] = e->msg.programchange.program;
 		break;
 	case PITCHWHEELCHANGE:
 		/* Beware of the byte order! (LSB first) */
-		buf[n++] = e->msg.pitchwheelchange.lsb;
-		buf[n++] = e->msg.pitchwheelchange.msb;
+		data[n++] = e->msg.pitchwheelchange.lsb;
+		data[n++] = e->msg.pitchwheelchange.msb;
 		break;
 	case KEYPRESSURE:
-		buf[n++] = e->msg.keypressure.note;
-		buf[n++] = e->msg.keypressure.velocity;
+		data[n++] = e->msg.keypressure.note;
+		data[n++] = e->msg.keypressure.velocity;
 		break;
 	case CHANNELPRESSURE:
-		buf[n++] = e->msg.channelpressure.velocity;
+		data[n++] = e->msg.channelpressure.velocity;
 		break;
 	case NOTEOFF:
-		buf[n++] = e->msg.noteoff.note;
-		buf[n++] = e->msg.noteoff.velocity;
+		data[n++] = e->msg.noteoff.note;
+		data[n++] = e->msg.noteoff.velocity;
+		if (f_zeronoteoff) {
+			cmd = NOTEON | (cmd & 0x0f);
+			data[1] = 0;
+		}
 		break;
 	case NOTEON:
-		buf[n++] = e->msg.noteon.note;
-		buf[n++] = e->msg.noteon.velocity;
+		data[n++] = e->msg.noteon.note;
+		data[n++] = e->msg.noteon.velocity;
 		break;
 	case CONTROLCHANGE:
-		buf[n++] = e->msg.controlchange.controller;
-		buf[n++] = e->msg.controlchange.value;
+		data[n++] = e->msg.controlchange.controller;
+		data[n++] = e->msg.controlchange.value;
 		break;
 	default:
-		n = 0;
-		break;
+		return 0;
 	}
-	if (!n)
-		return;
-	if (mio_write(hdl, buf, n) != n)
+
+	if (cmd == running) {
+		memcpy(buf, data, n);
+		return n;
+	}
+	buf[0] = running = cmd;
+	memcpy(buf + 1, data, n);
+	return n + 1;
+}
+
+static void playevent(MidiOut *out, MFEvent *e) {
+	unsigned char buf[3];
+	size_t n;
+	if ((n = encodeevent(e, buf)) && midiout_write(out, buf, n))
 		err(1, NULL);
 }
 
+/* Print the timing statistics of playing to stderr. */
+static void printstats(void) {
+	double sec = stats.usec / 1e6;
+	unsigned long writes, bytes;
+	uint64_t lo;
+	int i;
+
+	fprintf(stderr, "%lu events, %lu bytes in %lu batches, %.3f s\n",
+	    stats.events, stats.bytes, stats.batches, sec);
+	if (sec > 0)
+		fprintf(stderr, "%.1f events/s, %.1f bytes/s\n",
+		    stats.events / sec, stats.bytes / sec);
+	fprintf(stderr, "largest batch: %lu events, %lu bytes\n",
+	    stats.maxevents, stats.maxbytes);
+	if (midiout) {
+		writes = midiout_count(midiout, &bytes);
+		fprintf(stderr, "output: %lu writes, %lu bytes\n",
+		    writes, bytes);
+	}
+	if (!stats.timed)
+		return;
+	fprintf(stderr, "lateness: mean %llu us, max %llu us\n",
+	    (unsigned long long)(stats.late / stats.timed),
+	    (unsigned long long)stats.maxlate);
+	for (i = 0; i < PLAYHIST; i++) {
+		if (!stats.hist[i])
+			continue;
+		lo = i ? (uint64_t)1 << (i - 1) : 0;
+		if (i == PLAYHIST - 1)
+			fprintf(stderr, "  %8llu+         us: %lu\n",
+			    (unsigned long long)lo, stats.hist[i]);
+		else
+			fprintf(stderr, "  %8llu-%-8llu us: %lu\n",
+			    (unsigned long long)lo,
+			    (unsigned long long)((uint64_t)1 << i) - 1,
+			    stats.hist[i]);
+	}
+}
+
+/*
+ * Write `len' bytes at `buf' that are due `usec' microseconds after the
+ * start of the score to `out', or to the timing log if there is one.
+ */
+static void sendbuf(MidiOut *out, uint64_t usec, const unsigned char *buf,
+    size_t len) {
+	size_t i;
+
+	if (!tlog) {
+		if (midiout_write(out, buf, len))
+			err(1, NULL);
+		return;
+	}
+
+	fprintf(tlog, "%llu %llu", (unsigned long long)usec,
+	    (unsigned long long)play_time());
+	for (i = 0; i < len; i++)
+		fprintf(tlog, " %02x", buf[i]);
+	putc('\n', tlog);
+}
+
+/*
+ * Show and, if `ctx' is not NULL or there is a timing log, play the `n'
+ * events at `e', which are due `usec' microseconds after the start of
+ * the score. `ctx' is the midi output. The events are played with as
+ * few writes as possible.
+ */
+static unsigned long playbatch(MFEvent **e, unsigned long n, uint64_t usec,
+    void *ctx) {
+	MidiOut *out = ctx;
+	unsigned char buf[1024];
+	unsigned long i, sent = 0;
+	size_t len = 0;
+
+	if (report) {
+		report = 0;
+		printstats();
+	}
+
+	for (i = 0; i < n; i++) {
+		if (f_showevents)
+			printevent(e[i]);
+		if (!out && !tlog)
+			continue;
+		if (len > sizeof(buf) - 3) {
+			sendbuf(out, usec, buf, len);
+			sent += len;
+			len = 0;
+		}
+		len += encodeevent(e[i], buf + len);
+	}
+
+	if (len)
+		sendbuf(out, usec, buf, len);
+	return sent + len;
+}
+
 static void stopplay(int sig) {
 	stop = 1;
 }
 
+static void reportstats(int sig) {
+	(void) sig;
+	report = 1;
+}
+
 /* XXX: track channel states and write ordinary noteoff messages for
  * all active notes (or just send a system reset real time message).
  */
-static void shutup(struct mio_hdl *hdl) {
+static void shutup(MidiOut *out) {
 	int i;
 	MFEvent e;
 	e.time = 0;
@@ -318,49 +498,104 @@ static void shutup(struct mio_hdl *hdl) {
 		/* Reset all controllers. */
 		e.msg.controlchange.controller = 121;
 		e.msg.controlchange.value = 0;
-		playevent(hdl, &e);
+		playevent(out, &e);
 		/* All notes off. */
 		e.msg.controlchange.controller = 123;
-		playevent(hdl, &e);
+		playevent(out, &e);
 	}
 }
 
-/* Sleep for the given division, tempo and delta time. */
-static void msleep(int div, unsigned long tempo, unsigned long dt) {
-	struct timespec tmo, now;
-	static struct timespec then = {0, 0};
-	tmo.tv_sec = tempo * dt / div / 1000000;
-	tmo.tv_nsec = 1000 * tempo * dt / div % 1000000000;
-#ifdef DEBUG
-	printf("tmo:\t%32lld.%09ld\n", tmo.tv_sec, tmo.tv_nsec);
-#endif
-	/* Try to compensate any delay occurred between this and the
-	 * last msleep().
-	 */
-	if (clock_gettime(CLOCK_MONOTONIC, &now))
-		err(1, NULL);
-	if (then.tv_sec == 0 || then.tv_nsec == 0)
-		then = now;
-	timespecadd(&tmo, &then, &tmo);
-	timespecsub(&tmo, &now, &tmo);
-	timespecadd(&now, &tmo, &then);
-#ifdef DEBUG
-	printf("\t%32lld.%09ld\n", tmo.tv_sec, tmo.tv_nsec);
-#endif
-	if (tmo.tv_sec < 0 || tmo.tv_nsec < 0)
-		return;
-	if ((nanosleep(&tmo, NULL)) == -1 && errno != EINTR)
-		err(1, NULL);
+/*
+ * Convert the position `spec' within `s' to ticks at `tick'. Positions
+ * are given in ticks (1920), seconds (12.5s) or as bar and beat, both
+ * counted from 1 (17:3, or 17: for the start of a bar). Negative
+ * positions, ticks beyond LONG_MAX and seconds beyond MAXSECONDS are
+ * rejected. If `s' is NULL, only the syntax is checked.
+ * Returns 1 on success, else 0.
+ */
+static int position(Score *s, const char *spec, unsigned long *tick) {
+	unsigned long bar, beat = 1;
+	TempoMap *tm;
+	double sec;
+	int n;
+
+	/* Unsigned conversions would accept negative numbers. */
+	if (strchr(spec, '-')) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	n = 0;
+	if (sscanf(spec, "%lu:%n", &bar, &n) == 1 && n) {
+		spec += n;
+		if ((*spec && (sscanf(spec, "%lu%n", &beat, &n) != 1 ||
+		    spec[n])) || !bar || !beat) {
+			errno = EINVAL;
+			return 0;
+		}
+		if (!s)
+			return 1;
+		if (!tempo_bar(s, bar, beat, tick))
+			return 0;
+	} else if (sscanf(spec, "%lf%n", &sec, &n) == 1 && spec[n] == 's' &&
+	    !spec[n + 1]) {
+		if (!isfinite(sec) || sec < 0 || sec > MAXSECONDS) {
+			errno = ERANGE;
+			return 0;
+		}
+		if (!s)
+			return 1;
+		if (!(tm = tempo_new(s)))
+			return 0;
+		*tick = tempo_tick(tm, sec * 1e6);
+		tempo_free(tm);
+	} else if (sscanf(spec, "%lu%n", tick, &n) != 1 || spec[n]) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	/* Track times are signed. */
+	if (*tick > LONG_MAX) {
+		errno = ERANGE;
+		return 0;
+	}
+	return 1;
 }
 
-/* Output the track data of `s'. */
-static void showtracks(Score *s) {
+/*
+ * Play `s' from the positions given by `-s' and `-L', see `play_range'.
+ * Returns 1 on success, else 0.
+ */
+static int playrange(Score *s) {
+	unsigned long start = 0, from = 0, to = 0;
+
+	if (*loopfrom && (!position(s, loopfrom, &from) ||
+	    !position(s, loopto, &to)))
+		return 0;
+	if (*loopfrom && from >= to) {
+		midiprint(MPFatal, "empty loop range %s-%s", loopfrom, loopto);
+		exit(EXIT_FAILURE);
+	}
+	if (!startpos)
+		start = from;
+	else if (!position(s, startpos, &start))
+		return 0;
+
+	return play_range(s, start, from, to, playbatch, midiout, &stop,
+	    f_stats ? &stats : NULL);
+}
+
+/*
+ * Output the track data of `s', or, if `d' is not NULL, play the current
+ * score of `d' with the division `div' while it is decoded. If `cont' is
+ * nonzero, the score continues the score played before without a gap.
+ */
+static void showtracks(Score *s, Decoder *d, int div, int cont) {
 	MFEvent *e;
-	struct mio_hdl *hdl;
-	unsigned long tempo = 500000;	/* 120 bpm */
+	int ok = 1;
 	long t;
 
-	for (t = 0; t < s->ntrk; t++) {
+	for (t = 0; s && t < s->ntrk; t++) {
 		unsigned long ne = track_nevents(s->tracks[t]);
 
 		track_rewind(s->tracks[t]);
@@ -372,36 +607,32 @@ static void showtracks(Score *s) {
 	if (!f_showevents && !f_play)
 		return;
 
-	if (f_play && !(hdl = mio_open(MIO_PORTANY, MIO_OUT, 0)))
-		errx(1, "failed to open midi port");
-
-	for (t = 0; !stop && t < s->ntrk; t++) {
-		unsigned long lastt = 0;
-		while (!stop && (e = track_step(s->tracks[t], 0))) {
-			unsigned long dt = e->time - lastt;
-			lastt = e->time;
-			/* XXX: ensure that ENDOFTRACK is really the
-			 * last event of a track at load time and then
-			 * just terminate this loop on ENDOFTRACK.
-			 */
-			if (f_timed && dt &&
-			    e->msg.cmd != ENDOFTRACK)
-				msleep(s->div, tempo, dt);
-			if (e->msg.cmd == SETTEMPO)
-				tempo = e->msg.settempo.tempo;
-			if (f_showevents)
-				printevent(e);
-			if (f_play)
-				playevent(hdl, e);
-		}
+	if (f_play && !tlog && !midiout) {
+		if (!(midiout = midiout_open(outspec)))
+			errx(1, "failed to open midi output");
+		running = 0;
 	}
-	if (stop)
-		puts("");
 
-	if (f_play) {
-		shutup(hdl);
-		mio_close(hdl);
+	/* In real time, all tracks are walked through together. */
+	if (f_timed && d)
+		ok = play_decoder(d, div, cont, playbatch, midiout, &stop,
+		    f_stats ? &stats : NULL);
+	else if (f_timed && (startpos || *loopfrom))
+		ok = playrange(s);
+	else if (f_timed)
+		ok = play_score(s, playbatch, midiout, &stop,
+		    f_stats ? &stats : NULL);
+	if (!ok) {
+		midiprint(MPFatal, "%s", strerror(errno));
+		exit(EXIT_FAILURE);
 	}
+
+	for (t = 0; s && !stop && !f_timed && t < s->ntrk; t++)
+		while (!stop && (e = track_step(s->tracks[t], 0)))
+			printevent(e);
+
+	if (stop)
+		puts("");
 }
 
 /* Delete all tracks that are not within the given range. */
@@ -430,7 +661,10 @@ static void adjusttracks(Score *s, long from, long to) {
 static void group(Score *s) {
 	int t, n;
 	for (t = 0; t < s->ntrk; t++)
-		if ((n = pairNotes(s->tracks[t])) != 0)
+		if ((n = pairNotes(s->tracks[t])) < 0) {
+			midiprint(MPFatal, "%s", strerror(errno));
+			exit(EXIT_FAILURE);
+		} else if (n != 0)
 			midiprint(MPWarn, "track %d: %d unmatched notes", t, n);
 }
 
@@ -438,7 +672,10 @@ static void group(Score *s) {
 static void ungroup(Score *s) {
 	int t;
 	for (t = 0; t < s->ntrk; t++) {
-		(void) unpairNotes(s->tracks[t]);
+		if (unpairNotes(s->tracks[t]) < 0) {
+			midiprint(MPFatal, "%s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
 		compressNoteOff(s->tracks[t], 0);
 	}
 }
@@ -449,31 +686,22 @@ static void ungroup(Score *s) {
  * occurence).
  */
 static void mergetracks(Score *s) {
-	MFEvent *e;
+	Track *m;
 	unsigned long t;
 
-	for (t = 1; t < s->ntrk; t++) {
-		track_rewind(s->tracks[t]);
-		while ((e = track_step(s->tracks[t], 0))) {
-			if (!track_insert(s->tracks[0], e)) {
-				midiprint(MPFatal, "%s", strerror(errno));
-				exit(EXIT_FAILURE);
-			}
-			else
-				e->msg.cmd = EMPTY;
-		}
-		track_clear(s->tracks[t]);
+	if (s->ntrk < 2)
+		return;
+
+	if (!(m = track_merge(s->tracks, s->ntrk, s->arena))) {
+		midiprint(MPFatal, "%s", strerror(errno));
+		exit(EXIT_FAILURE);
 	}
 
-	s->ntrk = 1;
+	for (t = 0; t < s->ntrk; t++)
+		track_clear(s->tracks[t]);
 
-	/* Delete all but the last End Of Track events. */
-	track_rewind(s->tracks[0]);
-	e = track_step(s->tracks[0], 1);
-	assert(e != NULL && e->msg.cmd == ENDOFTRACK);
-	while ((e = track_step(s->tracks[0], 1)))
-		if (e->msg.cmd == ENDOFTRACK)
-			track_delete(s->tracks[0]);
+	s->tracks[0] = m;
+	s->ntrk = 1;
 }
 
 /*
@@ -505,9 +733,19 @@ static int write_tracks(MBUF *b, Score *s, int concat) {
 			running = 0;
 		}
 
+		/* Most events take up to four bytes. */
+		if (mbuf_reserve(b, 8 + 4 * track_nevents(s->tracks[t]))) {
+			midiprint(MPFatal, "%s", strerror(errno));
+			return 0;
+		}
+
 		track_rewind(s->tracks[t]);
 		while ((e = track_step(s->tracks[t], 0))) {
-			time += e->time -= time;
+			MFEvent d = *e;
+
+			/* Write delta times without touching the track. */
+			d.time -= time;
+			time = e->time;
 
 			/*
 			 * If we are in concat mode, we only write the very last EOT
@@ -515,7 +753,7 @@ static int write_tracks(MBUF *b, Score *s, int concat) {
 			 */
 			if ((!concat || t == s->ntrk - 1 ||
 				e->msg.cmd != ENDOFTRACK) &&
-				!write_event(b, e, &running)) {
+				!write_event(b, &d, &running)) {
 				if (errno)
 					midiprint(MPFatal, "%s", strerror(errno));
 				else
@@ -538,6 +776,103 @@ static int write_tracks(MBUF *b, Score *s, int concat) {
 	return 1;
 }
 
+/*
+ * Queue the stable buffer `b' of the current file for `playqueue'.
+ * Returns 0 on success, else 1.
+ */
+static int queuefile(MBUF *b) {
+	struct qfile *nq;
+	char *name;
+
+	if (!(name = strdup(warnname)) ||
+	    !(nq = realloc(queue, (nqueue + 1) * sizeof(*nq)))) {
+		midiprint(MPFatal, "%s", strerror(errno));
+		free(name);
+		mbuf_free(b);
+		return 1;
+	}
+
+	queue = nq;
+	queue[nqueue].b = b;
+	queue[nqueue].name = name;
+	queue[nqueue].nscores = 0;
+	nqueue++;
+
+	return 0;
+}
+
+/* Set the filename for messages of the decoder thread. */
+static void beginfile(unsigned long i) {
+	warnname = queue[i].name;
+}
+
+/*
+ * Play the scores of the queued files as a playlist while they are
+ * decoded. Playing starts without reading the files first, and the
+ * next score follows its predecessor without a gap.
+ * Returns 0 on success, else 1.
+ */
+static int playqueue(void) {
+	char *name = warnname;
+	Decoder *d = NULL;
+	unsigned long i;
+	int div, cont, result = 0;
+	MBUF **b;
+
+	if (!nqueue)
+		return 0;
+
+	error = 0;
+	if (!(b = malloc(nqueue * sizeof(*b)))) {
+		midiprint(MPFatal, "%s", strerror(errno));
+		result = 1;
+	} else {
+		for (i = 0; i < nqueue; i++)
+			b[i] = queue[i].b;
+		if (!(d = decoder_start(b, nqueue, beginfile))) {
+			midiprint(MPFatal, "%s", strerror(errno));
+			result = 1;
+		}
+	}
+
+	for (cont = 0; !result && !stop && decoder_score(d, &div, &i);
+	    cont = 1) {
+		warnname = queue[i].name;
+		if (f_showevents)
+			midiprint(MPNote, "%s(%d):", warnname,
+			    queue[i].nscores);
+		queue[i].nscores++;
+		showtracks(NULL, d, div, cont);
+	}
+
+	if (!result)
+		decoder_free(d);
+	free(b);
+
+	/* Errors of the decoder thread are known once it has ended. */
+	if (error)
+		result = 1;
+
+	for (i = 0; i < nqueue; i++) {
+		warnname = queue[i].name;
+		if (result || stop)
+			;
+		else if (!queue[i].nscores) {
+			midiprint(MPFatal, "no headers or tracks found");
+			result = 1;
+		} else if (mbuf_request(queue[i].b, 1))
+			midiprint(MPWarn, "garbage at end of input");
+		mbuf_free(queue[i].b);
+	}
+
+	warnname = name;
+	for (i = 0; i < nqueue; i++)
+		free(queue[i].name);
+	nqueue = 0;
+
+	return result;
+}
+
 /* Handle one filespec. */
 static int dofile(const char *spec) {
 	FILE *f = stdin;
@@ -600,16 +935,30 @@ static int dofile(const char *spec) {
 		return 1;
 	}
 
-	if (read_mbuf(b, f)) {
+	if (stream_mbuf(b, f)) {
+		midiprint(MPFatal, "%s", strerror(errno));
 		fclose(f);
 		mbuf_free(b);
 		return 1;
 	}
 
-	fclose(f);
-
 	error = 0;
 
+	/*
+	 * Scores that are played as they are don't need to be read
+	 * completely in advance. They are queued to be played as a
+	 * playlist together with the following files.
+	 */
+	if (f_timed && f_ungroup && !f_mergetracks && !f_showheaders &&
+	    !f_showtlengths && !outb && sc1 < 0 && tr1 < 0 && !startpos &&
+	    !*loopfrom && mbuf_stable(b)) {
+		fclose(f);
+		return queuefile(b);
+	}
+
+	/* Anything queued before is played first. */
+	error = playqueue();
+
 	for (scorenum = 0; (sc1 < 0 || scorenum <= sc1) && (s = score_read(b)); scorenum++) {
 		if (sc1 >= 0 && (sc0 > scorenum || scorenum > sc1))
 			continue;
@@ -634,7 +983,7 @@ static int dofile(const char *spec) {
 		if (outformat < 0)
 			outformat = s->fmt;
 
-		showtracks(s);
+		showtracks(s, NULL, 0, 0);
 
 		if (outb) {
 			ungroup(s);
@@ -648,9 +997,17 @@ static int dofile(const char *spec) {
 		score_clear(s);
 	}
 
+	if (mbuf_error(b)) {
+		midiprint(MPFatal, "%s", strerror(mbuf_error(b)));
+		mbuf_free(b);
+		fclose(f);
+		return 1;
+	}
+
 	if (!s && scorenum == 0) {
 		midiprint(MPFatal, "no headers or tracks found");
 		mbuf_free(b);
+		fclose(f);
 		return 1;
 	}
 
@@ -663,12 +1020,13 @@ static int dofile(const char *spec) {
 		midiprint(MPWarn, "garbage at end of input");
 
 	mbuf_free(b);
+	fclose(f);
 
 	return error ? 1 : 0;
 }
 
 int main(int argc, char *argv[]) {
-	unsigned long p = 0;
+	unsigned long p = 0, tick;
 	int opt;
 	int error = 0;
 
@@ -676,7 +1034,7 @@ int main(int argc, char *argv[]) {
 	char *outname = NULL;
 
 	/* Parse command line arguments. */
-	while ((opt = getopt(argc, argv, ":hleuqtnmo:p012cfd:")) != -1)
+	while ((opt = getopt(argc, argv, ":hleuqtnmo:pM:T:zSs:L:012cfd:")) != -1)
 		switch (opt) {
 		case 'h':
 			f_showheaders = 1;
@@ -708,8 +1066,34 @@ int main(int argc, char *argv[]) {
 		case 'o':
 			outname = optarg;
 			break;
+		case 'T':
+			if (!(tlog = fopen(optarg, "w")))
+				err(1, "%s", optarg);
+			play_virtual = 1;
+			f_play = f_ungroup = f_timed = 1;
+			break;
+		case 'M':
+			outspec = optarg;
+			/* FALLTHROUGH */
 		case 'p':
-			f_play = f_ungroup = f_mergetracks = f_timed = 1;
+			f_play = f_ungroup = f_timed = 1;
+			break;
+		case 'z':
+			f_zeronoteoff = 1;
+			break;
+		case 'S':
+			f_stats = 1;
+			break;
+		case 's':
+			startpos = optarg;
+			if (!position(NULL, startpos, &tick))
+				usage();
+			break;
+		case 'L':
+			if (sscanf(optarg, "%63[^-]-%63s", loopfrom, loopto) != 2 ||
+			    !position(NULL, loopfrom, &tick) ||
+			    !position(NULL, loopto, &tick))
+				usage();
 			break;
 		case '0':
 			outformat = 0;
@@ -735,6 +1119,9 @@ int main(int argc, char *argv[]) {
 	argc -= optind;
 	argv += optind;
 
+	/* Input buffers outlive their scores, so payloads need no copies. */
+	vld_borrow = 1;
+
 	if (outname) {
 		if (!(outb = mbuf_new())) {
 			perror(outname);
@@ -755,15 +1142,33 @@ int main(int argc, char *argv[]) {
 		err(1, NULL);
 	if (f_play && signal(SIGTERM, stopplay) == SIG_ERR)
 		err(1, NULL);
+	if (f_stats && signal(SIGUSR1, reportstats) == SIG_ERR)
+		err(1, NULL);
+#ifdef SIGINFO
+	if (f_stats && signal(SIGINFO, reportstats) == SIG_ERR)
+		err(1, NULL);
+#endif
 
 	if (!argc)
 		error = dofile(NULL);
 	else
 		while (argc--)
 			error |= dofile(*argv++);
+	error |= playqueue();
+
+	/* The statistics include the output, which is counted until closed. */
+	if (f_stats)
+		printstats();
+
+	if (midiout) {
+		shutup(midiout);
+		midiout_close(midiout);
+	}
 
 	if (outb)
 		p = mbuf_pos(outb) - p;
+	if (tlog && fclose(tlog))
+		err(1, "timing log");
 
 	if (error)
 		return EXIT_FAILURE;
@@ -0,0 +1,372 @@
+/* Playing scores in real time. */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "chase.h"
+#include "play.h"
+#include "tempo.h"
+
+/*
+ * If nonzero, `play_score' runs on a virtual clock that skips all sleeps
+ * instead of waiting for the deadlines.
+ */
+int play_virtual = 0;
+
+/*
+ * Start of the current score, time skipped by the virtual clock and
+ * time of the last events passed, relative to `start'.
+ */
+static struct timespec start;
+static uint64_t skipped;
+static uint64_t end;
+
+/*
+ * Returns the time in microseconds since `play_score' started the
+ * current score. With `play_virtual', the time skipped by sleeps is
+ * included, so only the time actually spent in playing passes.
+ */
+uint64_t play_time(void) {
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		return skipped;
+
+	/*
+	 * On the virtual clock, `start' may lie ahead of now by up to the
+	 * time skipped, so only the sum must not be negative.
+	 */
+	return (uint64_t)((int64_t)(now.tv_sec - start.tv_sec) * 1000000000 +
+	    (now.tv_nsec - start.tv_nsec) + (int64_t)skipped * 1000) / 1000;
+}
+
+/*
+ * Sleep until `usec' microseconds after the start of the score, or until
+ * `*stop' becomes nonzero. The virtual clock just skips ahead.
+ * Returns 0 on success, else -1.
+ */
+static int sleepuntil(uint64_t usec, volatile sig_atomic_t *stop) {
+	struct timespec ts;
+	uint64_t now;
+	int r;
+
+	if (play_virtual) {
+		if ((now = play_time()) < usec)
+			skipped += usec - now;
+		return 0;
+	}
+
+	ts.tv_sec = start.tv_sec + usec / 1000000;
+	ts.tv_nsec = start.tv_nsec + usec % 1000000 * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	while (!*stop && (r = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+	    &ts, NULL)) != 0)
+		if (r != EINTR) {
+			errno = r;
+			return -1;
+		}
+
+	return 0;
+}
+
+/*
+ * Add a batch of `n' events and `bytes' bytes to `st'. If `usec' is
+ * not UINT64_MAX, the batch was due `usec' microseconds after the start
+ * of the score; `base' is the playing time of `st' at that start.
+ */
+static void record(PlayStats *st, uint64_t base, uint64_t usec,
+    unsigned long n, unsigned long bytes) {
+	uint64_t now, late;
+	int i;
+
+	now = play_time();
+	st->usec = base + now;
+	st->batches++;
+	st->events += n;
+	st->bytes += bytes;
+	if (n > st->maxevents)
+		st->maxevents = n;
+	if (bytes > st->maxbytes)
+		st->maxbytes = bytes;
+
+	if (usec == UINT64_MAX)
+		return;
+
+	late = now > usec ? now - usec : 0;
+	for (i = 0; i < PLAYHIST - 1 && late >> i; i++)
+		;
+	st->hist[i] += n;
+	st->timed += n;
+	st->late += late * n;
+	if (late > st->maxlate)
+		st->maxlate = late;
+}
+
+/*
+ * Function to copy the next event of `src' in time order to `e'.
+ * Returns 1 on success, or 0 at the end.
+ */
+typedef int (*StepFunc)(void *src, MFEvent *e);
+
+/* Events to play, see `play'. */
+struct source {
+	StepFunc step;
+	void *src;
+	int div;
+	TempoMap *tm;		/* Tempo map of all events, or NULL. */
+	unsigned long from;	/* Time of the first events, ... */
+	unsigned long to;	/* ... and of the first events not played. */
+	MFEvent **chase;	/* Events to pass first, see `chase_events'. */
+	unsigned long nchase;
+};
+
+/*
+ * Play the events of `p', see `play_score'. The score starts at the
+ * tick `p->from'. If there is no tempo map, which is only the case for
+ * scores that are still being decoded, it is built from the events as
+ * they pass; changes of tempo only affect later times, so it is always
+ * complete where it is used. The chase events are passed right
+ * at the start. If `cont' is nonzero, the score starts when the last
+ * events of the score played before are due, or when the end of its
+ * range is, else now.
+ * Returns 1 on success, else 0.
+ */
+static int play(const struct source *p, int cont, PlayFunc f, void *ctx,
+    volatile sig_atomic_t *stop, PlayStats *st) {
+	MFEvent *events = NULL, **batch = NULL, *ne, **nb, e;
+	unsigned long n = 0, size = 0, bytes, i;
+	uint64_t usec, first, base = st ? st->usec : 0;
+	int more, wait = 0, result = 1;
+	TempoMap *tm;
+
+	if (!(tm = p->tm) && !(tm = tempo_alloc(p->div)))
+		return 0;
+	first = tempo_usec(tm, p->from);
+
+	if (cont) {
+		if (sleepuntil(end, stop)) {
+			if (tm != p->tm)
+				tempo_free(tm);
+			return 0;
+		}
+		start.tv_sec += end / 1000000;
+		start.tv_nsec += end % 1000000 * 1000;
+		if (start.tv_nsec >= 1000000000) {
+			start.tv_sec++;
+			start.tv_nsec -= 1000000000;
+		}
+	} else if (clock_gettime(CLOCK_MONOTONIC, &start)) {
+		if (tm != p->tm)
+			tempo_free(tm);
+		return 0;
+	} else
+		skipped = 0;
+	end = 0;
+
+	if (p->nchase && !*stop) {
+		bytes = f(p->chase, p->nchase, 0, ctx);
+		if (st)
+			record(st, base, UINT64_MAX, p->nchase, bytes);
+	}
+
+	while (result && !*stop) {
+		if ((more = p->step(p->src, &e)) && e.time >= p->to) {
+			/* The range ends when its end is due. */
+			end = tempo_usec(tm, p->to) - first;
+			more = 0;
+		}
+
+		/* Output the batch when the next time is reached. */
+		if (n && (!more || e.time != events[0].time)) {
+			usec = tempo_usec(tm, events[0].time) - first;
+			if (usec > end)
+				end = usec;
+			for (i = 0; i < n; i++)
+				batch[i] = &events[i];
+			if (wait && sleepuntil(usec, stop))
+				result = 0;
+			else if (!*stop) {
+				bytes = f(batch, n, usec, ctx);
+				if (st)
+					record(st, base,
+					    wait ? usec : UINT64_MAX, n, bytes);
+			}
+			n = wait = 0;
+		}
+
+		if (!more || !result)
+			break;
+
+		if (n == size) {
+			size = size ? 2 * size : 64;
+			if (!(ne = realloc(events, size * sizeof(*ne)))) {
+				result = 0;
+				break;
+			}
+			events = ne;
+			if (!(nb = realloc(batch, size * sizeof(*nb)))) {
+				result = 0;
+				break;
+			}
+			batch = nb;
+		}
+		events[n++] = e;
+		if (e.msg.cmd == SETTEMPO && tm != p->tm &&
+		    !tempo_add(tm, e.time, e.msg.settempo.tempo))
+			result = 0;
+		if (e.msg.cmd != ENDOFTRACK)
+			wait = 1;
+	}
+
+	free(events);
+	free(batch);
+	if (tm != p->tm)
+		tempo_free(tm);
+	return result;
+}
+
+/* Step function of score iterators. */
+static int iterstep(void *it, MFEvent *e) {
+	MFEvent *p;
+
+	if (!(p = score_iter_step(it, NULL)))
+		return 0;
+	*e = *p;
+	return 1;
+}
+
+/*
+ * Walk through the events of all tracks of `s' in time order and pass
+ * all events of the same time to `f' at once, as soon as their time has
+ * come. The times are absolute deadlines from the start of the score,
+ * so delays of single events don't add up. End Of Track events are
+ * passed on without waiting for them.
+ * Playing ends early if `*stop' becomes nonzero.
+ * If `st' is not NULL, the timing is added to its statistics.
+ * Returns 1 on success, else 0.
+ */
+int play_score(Score *s, PlayFunc f, void *ctx,
+    volatile sig_atomic_t *stop, PlayStats *st) {
+	struct source p;
+	ScoreIter *it;
+	int result;
+
+	if (!(p.tm = tempo_new(s)))
+		return 0;
+	if (!(it = score_iter_new(s))) {
+		tempo_free(p.tm);
+		return 0;
+	}
+	p.step = iterstep;
+	p.src = it;
+	p.div = s->div;
+	p.from = 0;
+	p.to = ULONG_MAX;
+	p.nchase = 0;
+	result = play(&p, 0, f, ctx, stop, st);
+	score_iter_free(it);
+	tempo_free(p.tm);
+
+	return result;
+}
+
+/*
+ * Play `s' as `play_score' does, but start at the tick `at'. The
+ * tracks are positioned through their time indices, and the state of
+ * the midi channels at that time is passed first (see `chase_events').
+ * If `from' is less than `to', the range from `from' up to `to' is
+ * then repeated until `*stop' becomes nonzero, each time starting with
+ * all controllers reset, all notes off and the channel state at `from'.
+ * A start within or after the range starts at `from'; the range ends at
+ * the end of the score at the latest.
+ * Returns 1 on success, else 0.
+ */
+int play_range(Score *s, unsigned long at, unsigned long from,
+    unsigned long to, PlayFunc f, void *ctx, volatile sig_atomic_t *stop,
+    PlayStats *st) {
+	MFEvent *events = NULL, **chase = NULL;
+	ChaseTable *c = NULL;
+	struct source p;
+	ChanState cs;
+	ScoreIter *it;
+	int loop = from < to, cont = 0, result;
+	unsigned long i;
+
+	if (loop && at >= to)
+		at = from;
+
+	p.step = iterstep;
+	p.div = s->div;
+	p.tm = NULL;
+	p.to = loop ? to : ULONG_MAX;
+	p.chase = chase = malloc(CHASEMAX * sizeof(*chase));
+	events = malloc(CHASEMAX * sizeof(*events));
+	result = chase && events && (p.tm = tempo_new(s)) &&
+	    (c = chase_new(s));
+
+	for (p.from = at; result && !*stop; p.from = from) {
+		if (!chase_state(c, s, p.from, &cs) ||
+		    !(it = score_iter_at(s, p.from))) {
+			result = 0;
+			break;
+		}
+
+		p.nchase = chase_events(&cs, cont, events);
+		for (i = 0; i < p.nchase; i++) {
+			events[i].time = p.from;
+			chase[i] = &events[i];
+		}
+
+		p.src = it;
+		result = play(&p, cont, f, ctx, stop, st);
+		score_iter_free(it);
+
+		/* A range that takes no time is not repeated. */
+		if (!loop || !end)
+			break;
+		cont = 1;
+	}
+
+	chase_free(c);
+	tempo_free(p.tm);
+	free(events);
+	free(chase);
+	return result;
+}
+
+/* Step function of decoders. */
+static int decoderstep(void *d, MFEvent *e) {
+	return decoder_step(d, e);
+}
+
+/*
+ * Play the current score of `d', which has the division `div' (see
+ * `decoder_score'), as `play_score' does. Events that the decoder has
+ * not passed yet are waited for. If `cont' is nonzero, the score
+ * continues the score played before: it starts exactly at the time of
+ * its last events, i.e. usually its End Of Track, instead of now.
+ * Returns 1 on success, else 0.
+ */
+int play_decoder(Decoder *d, int div, int cont, PlayFunc f, void *ctx,
+    volatile sig_atomic_t *stop, PlayStats *st) {
+	struct source p;
+
+	p.step = decoderstep;
+	p.src = d;
+	p.div = div;
+	/*
+	 * The score is not complete before it has been played, so the
+	 * tempo map is built from the events as they pass.
+	 */
+	p.tm = NULL;
+	p.from = 0;
+	p.to = ULONG_MAX;
+	p.nchase = 0;
+	return play(&p, cont, f, ctx, stop, st);
+}
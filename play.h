@@ -0,0 +1,98 @@
+/* Playing scores in real time. */
+
+#ifndef __PLAY_H__
+#define __PLAY_H__
+
+#include <signal.h>
+#include <stdint.h>
+
+#include "decode.h"
+#include "score.h"
+
+/*
+ * Function to output the `n' events at `e', which all have the same
+ * time. `usec' is their deadline in microseconds from the start of the
+ * score. `ctx' is the argument given to `play_score'.
+ * Returns the number of bytes sent.
+ */
+typedef unsigned long (*PlayFunc)(MFEvent **e, unsigned long n,
+    uint64_t usec, void *ctx);
+
+/* Number of buckets of the lateness histogram. */
+#define PLAYHIST	24
+
+/*
+ * Timing statistics of playing. The lateness of an event is the time
+ * from its deadline until the output function returned. Bucket 0 of
+ * the histogram counts events that were in time, bucket i > 0 events
+ * that were 2^(i-1) to 2^i - 1 microseconds late, and the last bucket
+ * also all later ones. Events that are not waited for are counted, but
+ * have no lateness.
+ */
+typedef struct {
+	unsigned long events;		/* # of events played. */
+	unsigned long timed;		/* # of events with a lateness. */
+	unsigned long batches;		/* # of calls of the output function. */
+	unsigned long bytes;		/* # of bytes sent. */
+	unsigned long maxevents;	/* Largest batch in events. */
+	unsigned long maxbytes;		/* Largest batch in bytes. */
+	uint64_t usec;			/* Time spent playing. */
+	uint64_t late;			/* Total lateness of all events. */
+	uint64_t maxlate;		/* Largest lateness. */
+	unsigned long hist[PLAYHIST];	/* Lateness histogram. */
+} PlayStats;
+
+/*
+ * If nonzero, `play_score' runs on a virtual clock that skips all sleeps
+ * instead of waiting for the deadlines. Everything else, including the
+ * time spent in the output function, takes as long as it does.
+ */
+extern int play_virtual;
+
+/*
+ * Returns the time in microseconds since `play_score' started the
+ * current score. With `play_virtual', the time skipped by sleeps is
+ * included, so only the time actually spent in playing passes.
+ */
+uint64_t play_time(void);
+
+/*
+ * Walk through the events of all tracks of `s' in time order and pass
+ * all events of the same time to `f' at once, as soon as their time has
+ * come. The times are absolute deadlines from the start of the score,
+ * so delays of single events don't add up. End Of Track events are
+ * passed on without waiting for them.
+ * Playing ends early if `*stop' becomes nonzero.
+ * If `st' is not NULL, the timing is added to its statistics.
+ * Returns 1 on success, else 0.
+ */
+int play_score(Score *s, PlayFunc f, void *ctx,
+    volatile sig_atomic_t *stop, PlayStats *st);
+
+/*
+ * Play `s' as `play_score' does, but start at the tick `at'. The
+ * tracks are positioned through their time indices, and the state of
+ * the midi channels at that time is passed first (see `chase_events').
+ * If `from' is less than `to', the range from `from' up to `to' is
+ * then repeated until `*stop' becomes nonzero, each time starting with
+ * all controllers reset, all notes off and the channel state at `from'.
+ * A start within or after the range starts at `from'; the range ends at
+ * the end of the score at the latest.
+ * Returns 1 on success, else 0.
+ */
+int play_range(Score *s, unsigned long at, unsigned long from,
+    unsigned long to, PlayFunc f, void *ctx, volatile sig_atomic_t *stop,
+    PlayStats *st);
+
+/*
+ * Play the current score of `d', which has the division `div' (see
+ * `decoder_score'), as `play_score' does. Events that the decoder has
+ * not passed yet are waited for. If `cont' is nonzero, the score
+ * continues the score played before: it starts exactly at the time of
+ * its last events, i.e. usually its End Of Track, instead of now.
+ * Returns 1 on success, else 0.
+ */
+int play_decoder(Decoder *d, int div, int cont, PlayFunc f, void *ctx,
+    volatile sig_atomic_t *stop, PlayStats *st);
+
+#endif /* __PLAY_H__ */
@@ -3,18 +3,27 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "print.h"
 #include "score.h"
+#include "vld.h"
 
 /* Create a new score. */
 Score *score_new(void) {
+	Arena *a;
 	Score *s;
 
-	if (!(s = malloc(sizeof *s)))
+	if (!(a = arena_new()))
 		return NULL;
 
+	if (!(s = arena_alloc(a, sizeof *s))) {
+		arena_free(a);
+		return NULL;
+	}
+
+	s->arena = a;
 	s->fmt = 0;
 	s->ntrk = 0;
 	s->div = 120;
@@ -30,11 +39,12 @@ Score *score_new(void) {
 int score_add(Score *s) {
 	Track **nt;
 
-	if (!(nt = realloc(s->tracks, (s->ntrk + 1) * sizeof(*nt))))
+	if (!(nt = arena_realloc(s->arena, s->tracks,
+	    s->ntrk * sizeof(*nt), (s->ntrk + 1) * sizeof(*nt))))
 		return 0;
 
 	s->tracks = nt;
-	if (!(s->tracks[s->ntrk] = track_new()))
+	if (!(s->tracks[s->ntrk] = track_new(s->arena)))
 		return 0;
 
 	s->ntrk++;
@@ -45,15 +55,23 @@ int score_add(Score *s) {
  * Read an event list from the next `size' bytes of the buffer into the
  * track `t', converting original delta times to absolute times.
  */
-static int read_events(MBUF *b, unsigned long size, Track *t) {
+static int _read_events(MBUF *b, unsigned long size, Track *t) {
 	unsigned long p = mbuf_pos(b);
 	unsigned long time = 0;
+	unsigned long n = b->end - b->cur;
 	char running = 0;
 	MFEvent e;
 
 	e.time = 0;
 	e.msg.cmd = EMPTY;
 
+	/*
+	 * Every event takes at least two bytes, so this is an upper bound
+	 * of the number of events. The chunk size may be bogus, thus only
+	 * the bytes at hand count. It's only a hint, so errors are ignored.
+	 */
+	(void) track_reserve(t, (size < n ? size : n) / 2 + 1);
+
 	while (size > 0 && mbuf_request(b, 1) && read_event(b, &e, &running) &&
 	    e.msg.cmd != ENDOFTRACK) {
 		time = e.time += time;
@@ -84,6 +102,21 @@ static int read_events(MBUF *b, unsigned long size, Track *t) {
 	return 1;
 }
 
+/*
+ * As above, but allocate the data of the events from the track's arena
+ * right away.
+ */
+static int read_events(MBUF *b, unsigned long size, Track *t) {
+	Arena *a = vld_arena;
+	int result;
+
+	vld_arena = t->arena;
+	result = _read_events(b, size, t);
+	vld_arena = a;
+
+	return result;
+}
+
 /*
  * Read the score header (if existing) and the first track header.
  * The header data is filled into the score structure and the size field
@@ -137,7 +170,8 @@ static long read_header(MBUF *b, Score *s) {
 	if (chunk.type != MTrk) {
 		midiprint(MPError, "no tracks");
 		/* Restore the position. */
-		mbuf_set(b, pos);
+		if (mbuf_set(b, pos) == MBUF_LOST)
+			midiprint(MPError, "can't go back to pos %lx", pos);
 		return -1;
 	}
 
@@ -165,7 +199,8 @@ static long read_track(MBUF *b) {
 		midiprint(MPError, "%ld bytes skipped", skip);
 
 	if (chunk.type != MTrk) {
-		mbuf_set(b, pos);
+		if (mbuf_set(b, pos) == MBUF_LOST)
+			midiprint(MPError, "can't go back to pos %lx", pos);
 		return -1;
 	}
 
@@ -227,15 +262,388 @@ Score *score_read(MBUF *b) {
 	return s;
 }
 
-/* Free all allocated data.  */
+/* Free all allocated data at once. */
 void score_clear(Score *s) {
-	long t;
+	arena_free(s->arena);
+}
 
-	for (t = 0; t < s->ntrk; t++)
-		track_clear(s->tracks[t]);
+/* Iterator state, see `score_iter_new'. */
+struct _ScoreIter {
+	Score *s;
+	unsigned long n;	/* # of tracks not at EOT. */
+	unsigned long *heap;	/* Those tracks, ordered by next event. */
+	MFEvent **next;		/* Next event of each track. */
+	uint64_t *keys;		/* Sort keys of these events. */
+};
+
+/* Returns nonzero if the next event of track `a' comes before `b's. */
+static int iter_before(ScoreIter *it, unsigned long a, unsigned long b) {
+	return it->keys[a] < it->keys[b] ||
+	    (it->keys[a] == it->keys[b] && a < b);
+}
 
-	if (s->tracks)
-		free(s->tracks);
+/* Sift the track at index `i' of the iterator's heap down. */
+static void iter_siftdown(ScoreIter *it, unsigned long i) {
+	unsigned long c, x = it->heap[i];
+
+	for (; (c = 2 * i + 1) < it->n; i = c) {
+		if (c + 1 < it->n &&
+		    iter_before(it, it->heap[c + 1], it->heap[c]))
+			c++;
+		if (!iter_before(it, it->heap[c], x))
+			break;
+		it->heap[i] = it->heap[c];
+	}
+	it->heap[i] = x;
+}
+
+/*
+ * Create an iterator over the events of `s' and rewind all its tracks.
+ * Returns NULL on errors.
+ */
+ScoreIter *score_iter_new(Score *s) {
+	return score_iter_at(s, 0);
+}
+
+/*
+ * Create an iterator over the events of `s' from the tick `time' on.
+ * The tracks are positioned through their time indices (see
+ * `track_find'), or rewound if `time' is 0.
+ * Returns NULL on errors.
+ */
+ScoreIter *score_iter_at(Score *s, unsigned long time) {
+	ScoreIter *it;
+	unsigned long i;
+	int t;
+
+	if (!(it = malloc(sizeof(*it))))
+		return NULL;
+
+	it->s = s;
+	it->n = 0;
+	it->heap = malloc(s->ntrk * sizeof(*it->heap));
+	it->next = malloc(s->ntrk * sizeof(*it->next));
+	it->keys = malloc(s->ntrk * sizeof(*it->keys));
+	if (s->ntrk && (!it->heap || !it->next || !it->keys)) {
+		score_iter_free(it);
+		return NULL;
+	}
+
+	for (t = 0; t < s->ntrk; t++) {
+		if (time)
+			it->next[t] = track_find(s->tracks[t], time);
+		else {
+			track_rewind(s->tracks[t]);
+			it->next[t] = track_step(s->tracks[t], 0);
+		}
+		if (it->next[t]) {
+			it->keys[t] = event_key(it->next[t]);
+			it->heap[it->n++] = t;
+		}
+	}
+	for (i = it->n / 2; i-- > 0; )
+		iter_siftdown(it, i);
 
-	free(s);
+	return it;
+}
+
+/*
+ * Step to the next event in time order. Events of the same order are
+ * taken from the tracks in the sequence of the tracks. If `trk' is not
+ * NULL, the number of the track containing the event is stored there.
+ * Returns the address of the event or NULL if all tracks are at EOT.
+ */
+MFEvent *score_iter_step(ScoreIter *it, long *trk) {
+	unsigned long t;
+	MFEvent *e;
+
+	if (!it->n)
+		return NULL;
+
+	t = it->heap[0];
+	e = it->next[t];
+	if (trk)
+		*trk = t;
+
+	if ((it->next[t] = track_step(it->s->tracks[t], 0)))
+		it->keys[t] = event_key(it->next[t]);
+	else
+		it->heap[0] = it->heap[--it->n];
+	iter_siftdown(it, 0);
+
+	return e;
+}
+
+/* Free an iterator. */
+void score_iter_free(ScoreIter *it) {
+	if (it) {
+		free(it->heap);
+		free(it->next);
+		free(it->keys);
+		free(it);
+	}
+}
+
+/* State of a track of a reader, see `score_reader_new'. */
+struct rtrack {
+	MBUF *b;		/* View of the track chunk. */
+	unsigned long time;	/* Time of the last event read. */
+	unsigned char running;
+	char eot;		/* End of track is read. */
+	char have;		/* `e' is the next event. */
+	MFEvent e;
+	MFEvent *run;		/* Events of the current time, in order. */
+	unsigned long nrun;
+	unsigned long irun;	/* Next event of `run'. */
+	unsigned long size;	/* Allocated size of `run'. */
+	uint64_t key;		/* Sort key of `run[irun]'. */
+};
+
+/* Reader state, see `score_reader_new'. */
+struct _ScoreReader {
+	Arena *arena;
+	unsigned long ntrk;
+	struct rtrack *tracks;
+	unsigned long n;	/* # of tracks with events left. */
+	unsigned long *heap;	/* Those tracks, ordered by next event. */
+};
+
+/*
+ * Read the next event of `t' into `t->e' the same way as `read_events'
+ * does, converting the delta time and adding a missing End Of Track.
+ * Returns 1 if there was an event left, else 0.
+ */
+static int reader_read(ScoreReader *r, struct rtrack *t) {
+	Arena *a = vld_arena;
+	int ok;
+
+	if (t->eot)
+		return 0;
+
+	vld_arena = r->arena;
+	ok = mbuf_request(t->b, 1) && read_event(t->b, &t->e, &t->running) &&
+	    t->e.msg.cmd != ENDOFTRACK;
+	vld_arena = a;
+
+	if (ok) {
+		t->time = t->e.time += t->time;
+		return 1;
+	}
+
+	t->eot = 1;
+	if (t->e.msg.cmd != ENDOFTRACK) {
+		midiprint(MPWarn, "inserting missing `End Of Track'");
+		t->e.time = t->time;
+		t->e.msg.cmd = ENDOFTRACK;
+	} else
+		t->e.time += t->time;
+
+	if (mbuf_request(t->b, 1))
+		midiprint(MPWarn, "ignoring events after `End Of Track'");
+
+	return 1;
+}
+
+/*
+ * Read all events of the next time of `t' into its run, ordered as
+ * `track_insert' orders them.
+ * Returns 1 on success, else 0.
+ */
+static int reader_fill(ScoreReader *r, struct rtrack *t) {
+	MFEvent *nr;
+	unsigned long i;
+	uint64_t key;
+
+	t->nrun = t->irun = 0;
+	if (!t->have && !(t->have = reader_read(r, t)))
+		return 1;
+
+	do {
+		if (t->nrun == t->size) {
+			t->size = t->size ? 2 * t->size : 16;
+			if (!(nr = realloc(t->run, t->size * sizeof(*nr))))
+				return 0;
+			t->run = nr;
+		}
+		key = event_key(&t->e);
+		for (i = t->nrun; i > 0 && event_key(&t->run[i - 1]) > key; i--)
+			t->run[i] = t->run[i - 1];
+		t->run[i] = t->e;
+		t->nrun++;
+	} while ((t->have = reader_read(r, t)) && t->e.time == t->run[0].time);
+
+	t->key = event_key(&t->run[0]);
+	return 1;
+}
+
+/* Returns nonzero if the next event of track `a' comes before `b's. */
+static int reader_before(ScoreReader *r, unsigned long a, unsigned long b) {
+	return r->tracks[a].key < r->tracks[b].key ||
+	    (r->tracks[a].key == r->tracks[b].key && a < b);
+}
+
+/* Sift the track at index `i' of the reader's heap down. */
+static void reader_siftdown(ScoreReader *r, unsigned long i) {
+	unsigned long c, x = r->heap[i];
+
+	for (; (c = 2 * i + 1) < r->n; i = c) {
+		if (c + 1 < r->n &&
+		    reader_before(r, r->heap[c + 1], r->heap[c]))
+			c++;
+		if (!reader_before(r, r->heap[c], x))
+			break;
+		r->heap[i] = r->heap[c];
+	}
+	r->heap[i] = x;
+}
+
+/*
+ * Start reading the next score from the stable buffer `b' (see
+ * `mbuf_stable'). Only the chunk headers are read right away; the
+ * events are read as they are stepped to. The division of the score is
+ * stored at `div'. Allocated data of the events is taken from `a'.
+ * Returns NULL on errors or if there is no score left.
+ */
+ScoreReader *score_reader_new(MBUF *b, Arena *a, int *div) {
+	struct rtrack *nt;
+	ScoreReader *r;
+	unsigned long pos;
+	long size;
+	Score hdr;
+	int ntrk;
+
+	if (!mbuf_stable(b) || !(r = malloc(sizeof(*r))))
+		return NULL;
+
+	r->arena = a;
+	r->ntrk = r->n = 0;
+	r->tracks = NULL;
+	r->heap = NULL;
+
+	/* Defaults as of `score_new'. */
+	hdr.fmt = 0;
+	hdr.ntrk = 0;
+	hdr.div = 120;
+
+	if ((size = read_header(b, &hdr)) < 0) {
+		score_reader_free(r);
+		return NULL;
+	}
+
+	ntrk = hdr.ntrk;
+	*div = hdr.div;
+
+	while (size >= 0) {
+		/* May be that this should be an error. */
+		if (!size)
+			midiprint(MPWarn, "empty track");
+
+		if (!(nt = realloc(r->tracks, (r->ntrk + 1) * sizeof(*nt)))) {
+			score_reader_free(r);
+			return NULL;
+		}
+		r->tracks = nt;
+		nt = &r->tracks[r->ntrk];
+		memset(nt, 0, sizeof(*nt));
+		nt->e.msg.cmd = EMPTY;
+
+		/* The chunk may claim more than there is. */
+		if (!mbuf_request(b, size))
+			size = b->end - b->cur;
+		pos = mbuf_pos(b);
+		if (!(nt->b = mbuf_view(b, pos, size))) {
+			score_reader_free(r);
+			return NULL;
+		}
+		mbuf_set(b, pos + size);
+		r->ntrk++;
+
+		size = read_track(b);
+	}
+
+	/* Check the number of tracks. */
+	if ((long)r->ntrk < ntrk)
+		midiprint(MPError, "%ld tracks missing", ntrk - (long)r->ntrk);
+	else if ((long)r->ntrk > ntrk)
+		midiprint(MPError, "%ld extraneous tracks", (long)r->ntrk - ntrk);
+
+	if (!r->ntrk)
+		midiprint(MPWarn, "empty score");
+
+	if (!(r->heap = malloc((r->ntrk ? r->ntrk : 1) * sizeof(*r->heap)))) {
+		score_reader_free(r);
+		return NULL;
+	}
+
+	for (pos = 0; pos < r->ntrk; pos++) {
+		if (!reader_fill(r, &r->tracks[pos])) {
+			score_reader_free(r);
+			return NULL;
+		}
+		if (r->tracks[pos].nrun)
+			r->heap[r->n++] = pos;
+	}
+	for (pos = r->n / 2; pos-- > 0; )
+		reader_siftdown(r, pos);
+
+	return r;
+}
+
+/*
+ * Step to the next event of the score in the order of `score_iter_step'
+ * after `score_read'. If `trk' is not NULL, the number of the track
+ * containing the event is stored there.
+ * Returns the address of the event, which is valid until the next step,
+ * or NULL at the end of the score or on errors.
+ */
+MFEvent *score_reader_step(ScoreReader *r, long *trk) {
+	struct rtrack *t;
+	MFEvent *e;
+
+	/*
+	 * Tracks whose run is used up are ordered by the earliest key of the
+	 * time of their next event. Their next run is only read when they
+	 * come first, so that the event returned last stays valid.
+	 */
+	for (;;) {
+		if (!r->n)
+			return NULL;
+		t = &r->tracks[r->heap[0]];
+		if (t->irun < t->nrun)
+			break;
+		if (!reader_fill(r, t)) {
+			r->n = 0;
+			return NULL;
+		}
+		reader_siftdown(r, 0);
+	}
+
+	if (trk)
+		*trk = r->heap[0];
+
+	e = &t->run[t->irun++];
+	if (t->irun < t->nrun)
+		t->key = event_key(&t->run[t->irun]);
+	else if (t->have)
+		t->key = event_key(&t->e) & ~(uint64_t)0xff;
+	else
+		r->heap[0] = r->heap[--r->n];
+	reader_siftdown(r, 0);
+
+	return e;
+}
+
+/* Free a reader. */
+void score_reader_free(ScoreReader *r) {
+	unsigned long t;
+
+	if (r) {
+		for (t = 0; t < r->ntrk; t++) {
+			mbuf_free(r->tracks[t].b);
+			free(r->tracks[t].run);
+		}
+		free(r->tracks);
+		free(r->heap);
+		free(r);
+	}
 }
@@ -3,17 +3,23 @@
 #ifndef __SCORE_H__
 #define __SCORE_H__
 
+#include "arena.h"
 #include "buffer.h"
 #include "event.h"
 #include "track.h"
 
-/* This contains the score header data and the tracks. */
+/*
+ * This contains the score header data and the tracks.
+ * The score itself, its tracks and their events are allocated from the
+ * score's arena.
+ */
 typedef struct {
 	int fmt;
 	int ntrk;
 	int div;	/* Ticks per quarter note (no SMPTE support
 			 * for now) */
 	Track **tracks;
+	Arena *arena;
 } Score;
 
 /* Create a new score. */
@@ -35,7 +41,67 @@ Score *score_read(MBUF *b);
 /* Write a score into a buffer. */
 int score_write(MBUF *b, Score *s);
 
-/* Free all allocated data. */
+/* Free all allocated data at once. */
 void score_clear(Score *s);
 
+/*
+ * Iterator over the events of all tracks of a score in time order. It
+ * only keeps a position per track, using the tracks' own positions, so
+ * the tracks must not be stepped or modified while iterating.
+ */
+typedef struct _ScoreIter ScoreIter;
+
+/*
+ * Create an iterator over the events of `s' and rewind all its tracks.
+ * Returns NULL on errors.
+ */
+ScoreIter *score_iter_new(Score *s);
+
+/*
+ * Create an iterator over the events of `s' from the tick `time' on.
+ * The tracks are positioned through their time indices (see
+ * `track_find'), or rewound if `time' is 0.
+ * Returns NULL on errors.
+ */
+ScoreIter *score_iter_at(Score *s, unsigned long time);
+
+/*
+ * Step to the next event in time order. Events of the same order are
+ * taken from the tracks in the sequence of the tracks. If `trk' is not
+ * NULL, the number of the track containing the event is stored there.
+ * Returns the address of the event or NULL if all tracks are at EOT.
+ */
+MFEvent *score_iter_step(ScoreIter *it, long *trk);
+
+/* Free an iterator. */
+void score_iter_free(ScoreIter *it);
+
+/*
+ * Reader of the events of a score in time order, which reads the
+ * tracks from the buffer only as far as they are needed. The events
+ * come in the same order as from `score_iter_step' after `score_read'.
+ */
+typedef struct _ScoreReader ScoreReader;
+
+/*
+ * Start reading the next score from the stable buffer `b' (see
+ * `mbuf_stable'). Only the chunk headers are read right away, so `b'
+ * is positioned after the score; the events are read as they are
+ * stepped to. The division of the score is stored at `div'. Allocated
+ * data of the events is taken from `a', which must outlive their use.
+ * Returns NULL on errors or if there is no score left.
+ */
+ScoreReader *score_reader_new(MBUF *b, Arena *a, int *div);
+
+/*
+ * Step to the next event of the score. If `trk' is not NULL, the
+ * number of the track containing the event is stored there.
+ * Returns the address of the event, which is valid until the next step,
+ * or NULL at the end of the score or on errors.
+ */
+MFEvent *score_reader_step(ScoreReader *r, long *trk);
+
+/* Free a reader. */
+void score_reader_free(ScoreReader *r);
+
 #endif /* __SCORE_H__ */
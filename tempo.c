@@ -0,0 +1,238 @@
+/* Conversion between ticks and real time. */
+
+#include <stdlib.h>
+
+#include "tempo.h"
+
+/* Tempo before the first SetTempo event: 120 bpm. */
+#define DEFTEMPO	500000
+
+/* A tempo change, see `tempo_new'. */
+struct change {
+	unsigned long tick;
+	unsigned long tempo;
+	unsigned long trk;	/* Track and ... */
+	unsigned long seq;	/* ... sequence within track. */
+};
+
+/*
+ * Order tempo changes by time, then like the events of merged tracks,
+ * so that the last of several changes at the same tick wins.
+ */
+static int _ccmp(const void *_c1, const void *_c2) {
+	const struct change *c1 = _c1;
+	const struct change *c2 = _c2;
+
+	if (c1->tick != c2->tick)
+		return c1->tick < c2->tick ? -1 : 1;
+	else if (c1->trk != c2->trk)
+		return c1->trk < c2->trk ? -1 : 1;
+	else if (c1->seq != c2->seq)
+		return c1->seq < c2->seq ? -1 : 1;
+	else
+		return 0;
+}
+
+/*
+ * Create a tempo map with division `div' and no tempo changes yet, i.e.
+ * 120 bpm throughout.
+ * Returns NULL on errors.
+ */
+TempoMap *tempo_alloc(int div) {
+	TempoMap *m;
+
+	if (!(m = malloc(sizeof(*m))) ||
+	    !(m->seg = malloc(sizeof(*m->seg)))) {
+		free(m);
+		return NULL;
+	}
+
+	m->div = div > 0 ? div : 1;
+	m->nseg = m->size = 1;
+	m->seg[0].tick = 0;
+	m->seg[0].tempo = DEFTEMPO;
+	m->seg[0].usec = 0;
+
+	return m;
+}
+
+/*
+ * Change the tempo to `tempo' at `tick', which must not come before
+ * the last change. A later change at the same tick replaces the former.
+ * Returns 1 on success, else 0.
+ */
+int tempo_add(TempoMap *m, unsigned long tick, unsigned long tempo) {
+	TempoSeg *seg = &m->seg[m->nseg - 1];
+
+	if (!tempo)
+		return 1;
+
+	if (tick == seg->tick) {
+		seg->tempo = tempo;
+		return 1;
+	}
+
+	if (m->nseg == m->size) {
+		if (!(seg = realloc(m->seg, 2 * m->size * sizeof(*seg))))
+			return 0;
+		m->seg = seg;
+		m->size *= 2;
+		seg = &m->seg[m->nseg - 1];
+	}
+
+	seg[1].tick = tick;
+	seg[1].tempo = tempo;
+	seg[1].usec = seg->usec +
+	    (uint64_t)(tick - seg->tick) * seg->tempo / m->div;
+	m->nseg++;
+	return 1;
+}
+
+/*
+ * Build the tempo map of `s' from the SetTempo events of all of its
+ * tracks. Before the first tempo change, 120 bpm are assumed.
+ * Tracks are rewound.
+ * Returns NULL on errors.
+ */
+TempoMap *tempo_new(Score *s) {
+	struct change *c = NULL, *nc;
+	unsigned long n = 0, size = 0, i;
+	TempoMap *m;
+	MFEvent *e;
+	long t;
+
+	/* Collect the tempo changes of all tracks. */
+	for (t = 0; t < s->ntrk; t++) {
+		track_rewind(s->tracks[t]);
+		while ((e = track_step(s->tracks[t], 0)))
+			if (e->msg.cmd == SETTEMPO && e->msg.settempo.tempo) {
+				if (n == size) {
+					size = size ? 2 * size : 16;
+					if (!(nc = realloc(c, size * sizeof(*c)))) {
+						free(c);
+						return NULL;
+					}
+					c = nc;
+				}
+				c[n].tick = e->time;
+				c[n].tempo = e->msg.settempo.tempo;
+				c[n].trk = t;
+				c[n].seq = n;
+				n++;
+			}
+		track_rewind(s->tracks[t]);
+	}
+
+	if (n > 1)
+		qsort(c, n, sizeof(*c), _ccmp);
+
+	if (!(m = tempo_alloc(s->div))) {
+		free(c);
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++)
+		if (!tempo_add(m, c[i].tick, c[i].tempo)) {
+			tempo_free(m);
+			m = NULL;
+			break;
+		}
+
+	free(c);
+	return m;
+}
+
+/* Get the real time in microseconds of the tick `tick'. */
+uint64_t tempo_usec(const TempoMap *m, unsigned long tick) {
+	unsigned long lo = 0, hi = m->nseg, mid;
+	const TempoSeg *seg;
+
+	/* Find the last segment starting at or before `tick'. */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (m->seg[mid].tick <= tick)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	seg = &m->seg[lo];
+	return seg->usec + (uint64_t)(tick - seg->tick) * seg->tempo / m->div;
+}
+
+/*
+ * Get the tick at the real time `usec', i.e. the last tick that doesn't
+ * start later.
+ */
+unsigned long tempo_tick(const TempoMap *m, uint64_t usec) {
+	unsigned long lo = 0, hi = m->nseg, mid;
+	const TempoSeg *seg;
+
+	/* Find the last segment starting at or before `usec'. */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (m->seg[mid].usec <= usec)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	/* Times of ticks are rounded down, see `tempo_usec'. */
+	seg = &m->seg[lo];
+	return seg->tick +
+	    ((usec - seg->usec + 1) * m->div - 1) / seg->tempo;
+}
+
+/*
+ * Get the tick at which the beat `beat' of the bar `bar' of `s' starts
+ * into `tick', both counted from 1, from the TimeSignature events of
+ * all tracks. Before the first one, 4/4 is assumed. A time signature
+ * that changes within a bar starts a new bar.
+ * Tracks are moved.
+ * Returns 1 on success, else 0.
+ */
+int tempo_bar(Score *s, unsigned long bar, unsigned long beat,
+    unsigned long *tick) {
+	unsigned long start = 0, n = 0, nb, barlen, beatlen;
+	int div = s->div > 0 ? s->div : 1, d;
+	ScoreIter *it;
+	MFEvent *e;
+
+	if (!(it = score_iter_new(s)))
+		return 0;
+
+	bar = bar ? bar - 1 : 0;
+	beat = beat ? beat - 1 : 0;
+	beatlen = div;
+	barlen = 4 * beatlen;
+
+	/* Find the last time signature before the bar, at `start'. */
+	while ((e = score_iter_step(it, NULL))) {
+		if (e->msg.cmd != TIMESIGNATURE)
+			continue;
+		nb = n + (e->time - start + barlen - 1) / barlen;
+		if (nb > bar)
+			break;
+		start = e->time;
+		n = nb;
+		d = e->msg.timesignature.denominator;
+		beatlen = d < 16 ? (unsigned long)4 * div >> d : 0;
+		if (!beatlen)
+			beatlen = 1;
+		barlen = e->msg.timesignature.nominator * beatlen;
+		if (!barlen)
+			barlen = beatlen;
+	}
+
+	score_iter_free(it);
+	*tick = start + (bar - n) * barlen + beat * beatlen;
+	return 1;
+}
+
+/* Free a tempo map. */
+void tempo_free(TempoMap *m) {
+	if (m) {
+		free(m->seg);
+		free(m);
+	}
+}
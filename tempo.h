@@ -0,0 +1,75 @@
+/* Conversion between ticks and real time. */
+
+#ifndef __TEMPO_H__
+#define __TEMPO_H__
+
+#include <stdint.h>
+
+#include "score.h"
+
+/*
+ * A tempo map consists of segments of constant tempo, each starting at
+ * a tempo change. For each segment, the real time of its start is kept.
+ */
+typedef struct {
+	unsigned long tick;	/* Start of segment. */
+	unsigned long tempo;	/* Microseconds per quarter note. */
+	uint64_t usec;		/* Real time of `tick'. */
+} TempoSeg;
+
+typedef struct {
+	int div;		/* Ticks per quarter note. */
+	unsigned long nseg;	/* # of segments, at least one. */
+	unsigned long size;	/* # of allocated segments. */
+	TempoSeg *seg;
+} TempoMap;
+
+/*
+ * Create a tempo map with division `div' and no tempo changes yet, i.e.
+ * 120 bpm throughout.
+ * Returns NULL on errors.
+ */
+TempoMap *tempo_alloc(int div);
+
+/*
+ * Change the tempo to `tempo' microseconds per quarter note at `tick',
+ * which must not come before the last change. A later change at the
+ * same tick replaces the former. Changes to a tempo of 0 are ignored.
+ * This way, a tempo map can be built while the events are walked
+ * through in time order.
+ * Returns 1 on success, else 0.
+ */
+int tempo_add(TempoMap *m, unsigned long tick, unsigned long tempo);
+
+/*
+ * Build the tempo map of `s' from the SetTempo events of all of its
+ * tracks. Before the first tempo change, 120 bpm are assumed.
+ * Tracks are rewound.
+ * Returns NULL on errors.
+ */
+TempoMap *tempo_new(Score *s);
+
+/* Get the real time in microseconds of the tick `tick'. */
+uint64_t tempo_usec(const TempoMap *m, unsigned long tick);
+
+/*
+ * Get the tick at the real time `usec', i.e. the last tick that doesn't
+ * start later.
+ */
+unsigned long tempo_tick(const TempoMap *m, uint64_t usec);
+
+/*
+ * Get the tick at which the beat `beat' of the bar `bar' of `s' starts
+ * into `tick', both counted from 1, from the TimeSignature events of
+ * all tracks. Before the first one, 4/4 is assumed. A time signature
+ * that changes within a bar starts a new bar.
+ * Tracks are moved.
+ * Returns 1 on success, else 0.
+ */
+int tempo_bar(Score *s, unsigned long bar, unsigned long beat,
+    unsigned long *tick);
+
+/* Free a tempo map. */
+void tempo_free(TempoMap *m);
+
+#endif /* __TEMPO_H__ */
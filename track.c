@@ -7,80 +7,157 @@
 
 #include "track.h"
 
+/* Number of events per entry of the time index. */
+#define BLOCK	64
+
 /*
- * Build a new track.
+ * Build a new track. If `a' is not NULL, the track, its events and the
+ * data of its events are allocated from the arena `a'.
  * The function returns a pointer to the new (empty) track or NULL on
  * errors.
  */
-Track *track_new(void) {
+Track *track_new(Arena *a) {
 	Track *t;
 
-	if (!(t = malloc(sizeof(*t))))
+	if (!(t = a ? arena_alloc(a, sizeof(*t)) : malloc(sizeof(*t))))
 		return NULL;
 
+	t->arena = a;
 	t->events = NULL;
-	t->current = t->nempty = t->nevents = 0;
+	t->current = t->nempty = t->nevents = t->size = t->sorted = 0;
+	t->index = NULL;
+	t->nindex = t->isize = 0;
 	t->inserting = 0;
 	return t;
 }
 
 /*
- * Enlarge a track by one entry.
+ * Set the number of allocated events to `size', which must not be less
+ * than the number of events.
+ * Returns 1 on success, else 0.
+ */
+static int resize(Track *t, unsigned long size) {
+	MFEvent *new;
+
+	if (t->arena)
+		new = arena_realloc(t->arena, t->events,
+		    t->size * sizeof(*new), size * sizeof(*new));
+	else
+		new = realloc(t->events, size * sizeof(*new));
+	if (!new && size)
+		return 0;
+
+	t->events = new;
+	t->size = size;
+	return 1;
+}
+
+/*
+ * Enlarge a track by one entry. The allocation grows geometrically, so
+ * that filling a track takes a logarithmic number of reallocs.
  * The nevents field is updated and the address of the new (last) event
  * is returned. If an error occurs (out of memory), a NULL pointer is
  * returned.
  */
 static MFEvent *enlarge(Track *t) {
-	MFEvent *new;
-
-	if (!(new = realloc(t->events, (t->nevents + 1) * sizeof(*new))))
+	if (t->nevents == t->size &&
+	    !resize(t, t->size ? 2 * t->size : 16))
 		return NULL;
 
-	t->events = new;
 	t->nevents++;
 	return &(t->events[t->nevents-1]);
 }
 
 /*
- * Shrink the track by `n' events. This means that the last `n' events
- * of the track become invalid.
+ * Make sure that `n' further events can be inserted without enlarging
+ * the track again.
+ * Returns 1 on success, else 0.
  */
-static void shrink(Track *t, unsigned long n) {
-	unsigned long x = 1024;
+int track_reserve(Track *t, unsigned long n) {
+	if (t->size - t->nevents >= n)
+		return 1;
 
-	/* Get the new blocksize. */
-	while (x < t->nevents - n)
-		x += x;
+	return resize(t, t->nevents + n);
+}
 
-	/* Only realloc if we did skip a block boundary. */
-	if (t->nevents >= 2 * x)
-		t->events = realloc(t->events, x * sizeof(*(t->events)));
+/*
+ * Allocate memory for `n' events to replace the events of `t' with
+ * `track_adopt'.
+ * Returns NULL on errors.
+ */
+MFEvent *track_alloc(Track *t, unsigned long n) {
+	if (t->arena)
+		return arena_alloc(t->arena, n * sizeof(MFEvent));
+	else
+		return malloc(n * sizeof(MFEvent));
+}
+
+/*
+ * Replace the events of `t' by the `n' events at `e', which must be
+ * allocated with `track_alloc' and be sorted. The old events are freed,
+ * but not their data, which is supposed to be moved to `e'.
+ * The position will be EOT.
+ */
+void track_adopt(Track *t, MFEvent *e, unsigned long n) {
+	if (!t->arena)
+		free(t->events);
+
+	t->events = e;
+	t->nevents = t->size = t->sorted = t->current = n;
+	t->nempty = t->nindex = 0;
+	t->inserting = 0;
+}
 
+/*
+ * Shrink the track by `n' events. This means that the last `n' events
+ * of the track become invalid. The allocation is halved once no more
+ * than a quarter of it is used, so that alternating deletions and
+ * insertions don't realloc each time.
+ */
+static void shrink(Track *t, unsigned long n) {
 	t->nevents -= n;
 	if (t->current > t->nevents)
 		t->current = t->nevents;
+
+	if (t->size > 16 && t->nevents <= t->size / 4)
+		(void) resize(t, t->size / 2);
 }
 
 /*
- * Pack a track, i.e. fill in all gaps (empty events) by shifting events
- * down.
+ * Remove all deleted events and, if `pred' is not NULL, all events for
+ * which `pred' returns nonzero, by shifting the remaining events down in
+ * a single pass. `pred' is called for the events in order, each already
+ * at its final position, if it's kept.
+ * The position will be EOT. Returns the number of removed events, not
+ * counting deleted ones.
  */
-static void pack(Track *t) {
-	unsigned long from, to;
+static unsigned long compact(Track *t, int (*pred)(MFEvent *, void *),
+    void *ctx) {
+	unsigned long from, to, n;
 
-	from = to = 0;
-	while (from < t->nevents)
+	for (from = to = 0; from < t->nevents; from++) {
 		if (t->events[from].msg.cmd == EMPTY)
-			from++;
-		else if (to < from) {
-			if (t->current == from)
-				t->current = to;
-			t->events[to++] = t->events[from++];
-		} else
-			to++, from++;
-
-	shrink(t, t->nempty);
-	t->nempty = 0;
+			continue;
+		if (to < from)
+			t->events[to] = t->events[from];
+		if (pred && pred(&t->events[to], ctx))
+			clear_message(&t->events[to].msg);
+		else
+			to++;
+	}
+
+	n = t->nevents - t->nempty - to;
+	t->nempty = t->nindex = 0;
+	shrink(t, t->nevents - to);
+	t->current = t->nevents;
+
+	return n;
+}
+
+/* Pack a track, i.e. fill in all gaps (deleted events). */
+static void pack(Track *t) {
+	if (t->nempty)
+		(void) compact(t, NULL, NULL);
 }
 
 /* Start or continue insertion of events. */
@@ -89,80 +166,115 @@ static void start_insertion(Track *t) {
 		return;
 
 	pack(t);
+	t->sorted = t->nevents;
+	t->nindex = 0;
 	t->inserting = 1;
 }
 
+/* Sort keys of events, see `event_key'. */
+struct key {
+	uint64_t key;
+	unsigned long idx;	/* Index of the event within the track. */
+};
+
 /*
- * Comparision function for sorting of events.
- * For equal-timed events, the following partial order holds:
- *   Any event           < End of track
- *   Other meta event    < Voice event
- *   Voice event ch=x    < Voice event ch=y, if x < y
- *   Program change      < Other voice event
- *   Control change      < Other voice event
- *   Note off            < Note on
- * In all other cases, this function is order-preserving, i.e.
- * the addresses are compared.
+ * Stable LSD radix sort of the `n' keys at `k', using `tmp' as scratch
+ * space for `n' keys. Bytes that are the same for all keys are skipped.
+ * Returns either `k' or `tmp', whichever holds the result.
  */
+static struct key *rsort(struct key *k, unsigned long n, struct key *tmp) {
+	unsigned long count[256], i, sum, c;
+	struct key *x;
+	int shift;
+
+	for (shift = 0; shift < 64; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[(k[i].key >> shift) & 0xff]++;
+		if (count[(k[0].key >> shift) & 0xff] == n)
+			continue;
+
+		for (i = sum = 0; i < 256; i++) {
+			c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			tmp[count[(k[i].key >> shift) & 0xff]++] = k[i];
+
+		x = k, k = tmp, tmp = x;
+	}
+
+	return k;
+}
 
-#define isVoice(e)    ((e)->msg.cmd != 0xff && \
-			((e)->msg.cmd & 0xf0))
-#define isMeta(e)     (!isVoice(e))
-#define isProgram(e)  (((e)->msg.cmd & 0xf0) == PROGRAMCHANGE)
-#define isControl(e)  (((e)->msg.cmd & 0xf0) == CONTROLCHANGE)
-#define isNoteOn(e)   (((e)->msg.cmd & 0xf0) == NOTEON && \
-			(e)->msg.noteon.velocity != 0)
-#define isNoteOff(e)  (((e)->msg.cmd & 0xf0) == NOTEOFF || \
-			((e)->msg.cmd & 0xf0) == NOTEON && \
-			(e)->msg.noteon.velocity == 0)
-
-static int _ecmp(const void *_e1, const void *_e2) {
-	const MFEvent *e1 = _e1;
-	const MFEvent *e2 = _e2;
-
-	if (e1->time < e2->time)
-		return -1;
-	else if (e1->time > e2->time)
-		return 1;
-	else if (e2->msg.cmd == ENDOFTRACK)
-		return -1;
-	else if (e1->msg.cmd == ENDOFTRACK)
-		return 1;
-	else if (isMeta(e1) && isVoice(e2))
-		return -1;
-	else if (isMeta(e2) && isVoice(e1))
-		return 1;
-	else if (isVoice(e1) && isVoice(e2) && CHN(e1->msg) < CHN(e2->msg))
-		return -1;
-	else if (isVoice(e1) && isVoice(e2) && CHN(e2->msg) < CHN(e1->msg))
-		return 1;
-	else if (isProgram(e1) && !isProgram(e2))
-		return -1;
-	else if (isProgram(e2) && !isProgram(e1))
-		return 1;
-	else if (isControl(e1) && !isControl(e2))
-		return -1;
-	else if (isControl(e2) && !isControl(e1))
-		return 1;
-	else if (isNoteOff(e1) && isNoteOn(e2))
-		return -1;
-	else if (isNoteOff(e2) && isNoteOn(e1))
-		return 1;
-	else if (e1 < e2)
-		return -1;
-	else if (e1 > e2)
-		return 1;
-	else
-		return 0;
+/*
+ * Insert the events from index `p' on one at a time into the sorted
+ * events in front of them. This is used if there's no memory left for
+ * sorting.
+ */
+static void isort(Track *t, unsigned long p) {
+	unsigned long i;
+	uint64_t key;
+	MFEvent e;
+
+	for (; p < t->nevents; p++) {
+		e = t->events[p];
+		key = event_key(&e);
+		for (i = p; i > 0 && event_key(&t->events[i - 1]) > key; i--)
+			t->events[i] = t->events[i - 1];
+		t->events[i] = e;
+	}
 }
 
-/* If in insertion mode, end insertion. */
+/*
+ * If in insertion mode, end insertion. The events appended after the
+ * sorted prefix of the track are sorted and merged into the prefix.
+ * Equal events keep the order of insertion.
+ */
 static void stop_insertion(Track *t) {
+	unsigned long p, n, i, j, k;
+	struct key *keys, *sk;
+	MFEvent *tmp;
+
 	if (!t || !t->inserting)
 		return;
 
 	t->inserting = 0;
-	qsort(t->events, t->nevents, sizeof(*(t->events)), _ecmp);
+
+	p = t->sorted;
+	n = t->nevents - p;
+	t->sorted = t->nevents;
+	if (!n)
+		return;
+
+	keys = malloc(2 * n * sizeof(*keys));
+	tmp = malloc(n * sizeof(*tmp));
+	if (!keys || !tmp) {
+		free(keys);
+		free(tmp);
+		isort(t, p);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		keys[i].key = event_key(&t->events[p + i]);
+		keys[i].idx = p + i;
+	}
+	sk = rsort(keys, n, keys + n);
+	for (i = 0; i < n; i++)
+		tmp[i] = t->events[sk[i].idx];
+
+	/* Merge from the end, the prefix wins ties. */
+	i = p, j = n, k = p + n;
+	while (j > 0)
+		if (i > 0 && event_key(&t->events[i - 1]) > sk[j - 1].key)
+			t->events[--k] = t->events[--i];
+		else
+			t->events[--k] = tmp[--j];
+
+	free(keys);
+	free(tmp);
 }
 
 /*
@@ -184,8 +296,10 @@ unsigned long track_nevents(Track *t) {
 /* Rewind the track position. If `t' is NULL, do nothing. */
 void track_rewind(Track *t) {
 	stop_insertion(t);
-	if (t)
+	if (t) {
+		pack(t);
 		t->current = t->nevents;
+	}
 }
 
 /*
@@ -236,41 +350,98 @@ MFEvent *track_step(Track *t, int rew) {
 	return e;
 }
 
+/*
+ * Build the time index of `t', i.e. the times of every BLOCK-th event.
+ * Returns 1 on success, else 0.
+ */
+static int buildindex(Track *t) {
+	unsigned long n = (t->nevents + BLOCK - 1) / BLOCK, i;
+	unsigned long *new;
+
+	if (n > t->isize) {
+		if (t->arena)
+			new = arena_realloc(t->arena, t->index,
+			    t->isize * sizeof(*new), n * sizeof(*new));
+		else
+			new = realloc(t->index, n * sizeof(*new));
+		if (!new)
+			return 0;
+		t->index = new;
+		t->isize = n;
+	}
+
+	for (i = 0; i < n; i++)
+		t->index[i] = t->events[i * BLOCK].time;
+	t->nindex = n;
+
+	return 1;
+}
+
+/*
+ * Get the index of the first event within `lo' and `hi' (exclusive)
+ * with a time equal to or greater than `time', or `hi' if there is none.
+ */
+static unsigned long lower(Track *t, unsigned long lo, unsigned long hi,
+    unsigned long time) {
+	unsigned long mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (t->events[mid].time < time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
 /*
  * Search the first event with a time field equal to or greater than
  * `time'. Returns the found event, or NULL, if EOT is reached.
  * In both cases, the position will be updated, i.e. will be either the
  * position of the found event or EOT.
+ * The search uses an index of the event times, which is rebuilt after
+ * the track has been modified. Thus, don't change event times in place.
  */
-MFEvent *_track_find(Track *t, long time) {
-	unsigned long size, pos;
+MFEvent *track_find(Track *t, long time) {
+	unsigned long lo, hi, mid;
 
+	stop_insertion(t);
 	if (!t || !t->nevents)
 		return NULL;
 
-	pos = 0;
-	size = t->nevents / 2;
-	while (size > 0)
-		if (t->events[pos + size].time < time) {
-			pos += size;
-			size = (t->nevents - pos) / 2;
-		} else
-			size /= 2;
+	if (time <= 0)
+		t->current = 0;
+	else if (!t->nindex && !buildindex(t))
+		t->current = lower(t, 0, t->nevents, time);
+	else {
+		/* Find the last block starting before `time'. */
+		lo = 0, hi = t->nindex;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (t->index[mid] < (unsigned long)time)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		/* The event is within this block or starts the next one. */
+		if (lo == 0)
+			t->current = 0;
+		else {
+			lo = (lo - 1) * BLOCK;
+			hi = lo + BLOCK < t->nevents ? lo + BLOCK : t->nevents;
+			t->current = lower(t, lo, hi, time);
+		}
+	}
 
-	t->current = pos + 1;
-
-	return &(t->events[t->current]);
-}
-
-MFEvent *track_find(Track *t, long time) {
-	MFEvent *e;
-
-	stop_insertion(t);
-	e = _track_find(t, time);
-	if (e && e->msg.cmd == EMPTY)
-		e = track_step(t, 0);
-
-	return e;
+	if (t->current >= t->nevents)
+		return NULL;
+	else if (t->events[t->current].msg.cmd == EMPTY)
+		return track_step(t, 0);
+	else
+		return &t->events[t->current];
 }
 
 /* Completely delete a track. */
@@ -279,14 +450,20 @@ void track_clear(Track *t) {
 	if (!t)
 		return;
 
+	/* Everything belongs to the arena. */
+	if (t->arena)
+		return;
+
 	for (pos = 0; pos < t->nevents; pos++)
 		clear_message(&(t->events[pos].msg));
 
 	if (t->events)
 		free(t->events);
+	free(t->index);
 
 	t->events = NULL;
-	t->nevents = t->current = t->nempty = 0;
+	t->index = NULL;
+	t->nevents = t->size = t->current = t->nempty = t->sorted = 0;
 	t->inserting = 0;
 
 	free(t);
@@ -294,7 +471,8 @@ void track_clear(Track *t) {
 
 /*
  * Delete the event at the current position and increase the position,
- * i.e. set the position to the next element.
+ * i.e. set the position to the next element. The event is only marked
+ * as deleted; the track is packed on the next rewind or insertion.
  * If the current position is EOT, or the track is empty at all, return
  * 0, else 1. In other words, this function returns the number of
  * deleted events.
@@ -305,19 +483,27 @@ int track_delete(Track *t) {
 		return 0;
 
 	clear_message(&(t->events[t->current].msg));
-	t->events[t->current].msg.cmd = EMPTY;
+	t->nempty++;
+	track_step(t, 0);
 
-	  if (t->current + 1 < t->nevents) {
-		t->events[t->current].time = t->events[t->current + 1].time;
-		t->nempty++;
-		track_step(t, 0);
-	} else
-		t->events[t->current].time = -1;
+	return 1;
+}
 
-	if (t->nevents < 2 * t->nempty)
-		pack(t);
+/*
+ * Remove all events of `t' for which `pred' returns nonzero in a single
+ * pass. `pred' is called for the events in order, with `ctx' as second
+ * argument. The event passed to `pred' is already at its final
+ * position, if it's kept, so its address stays valid until the track is
+ * modified otherwise. Data of removed events is freed.
+ * The position will be EOT. Returns the number of removed events.
+ */
+unsigned long track_remove_if(Track *t, int (*pred)(MFEvent *, void *),
+    void *ctx) {
+	if (!t)
+		return 0;
 
-	return 1;
+	stop_insertion(t);
+	return compact(t, pred, ctx);
 }
 
 /*
@@ -325,17 +511,169 @@ int track_delete(Track *t) {
  * If there are already events at the time of `e' within `t', `e' will
  * be the last event with this time. It is not possible to insert events
  * in front of a track that already contains events of time 0.
+ * If `t' has an arena, allocated data of `e' is moved into it and must
+ * not be freed by the caller any more.
  * The position will be undefined.
  * This function returns 1 on succes, else 0.
  */
 int track_insert(Track *t, MFEvent *e) {
 	MFEvent *new;
+	struct vld *vld;
+	uint64_t key;
 
 	start_insertion(t);
 
+	if (t->arena && (vld = message_data(&e->msg)) &&
+	    !vld_move(vld, t->arena))
+		return 0;
+
 	if (!(new = enlarge(t)))
 		return 0;
 
 	*new = *e;
+
+	/*
+	 * As long as the track is sorted, keep it that way: later events
+	 * are simply appended, events of the same time are moved in front
+	 * of the events they belong before. Anything else is sorted when
+	 * the insertion ends.
+	 */
+	if (t->sorted == t->nevents - 1) {
+		if (new > t->events && new[-1].time == new->time) {
+			key = event_key(new);
+			while (new > t->events && new[-1].time == new->time &&
+			    event_key(&new[-1]) > key) {
+				new[0] = new[-1];
+				*--new = *e;
+			}
+		}
+		if (new == t->events || new[-1].time <= new->time)
+			t->sorted++;
+	}
+
 	return 1;
 }
+
+/*
+ * Sift the track at index `i' of a merge heap of `n' tracks down, see
+ * `track_merge'. Tracks are ordered by the keys of their next events,
+ * then by their numbers.
+ */
+static void siftdown(unsigned long *heap, unsigned long n, unsigned long i,
+    const uint64_t *keys) {
+	unsigned long c, x = heap[i];
+
+	for (; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && (keys[heap[c + 1]] < keys[heap[c]] ||
+		    (keys[heap[c + 1]] == keys[heap[c]] &&
+		    heap[c + 1] < heap[c])))
+			c++;
+		if (keys[x] < keys[heap[c]] ||
+		    (keys[x] == keys[heap[c]] && x < heap[c]))
+			break;
+		heap[i] = heap[c];
+	}
+	heap[i] = x;
+}
+
+/*
+ * Step `pos' to the next event of `t' that is to be merged, i.e. skip
+ * deleted events and End Of Track events. The time of the last event is
+ * stored at `end'.
+ * Returns 1 if there is such an event, else 0.
+ */
+static int nextmerge(Track *t, unsigned long *pos, unsigned long *end) {
+	MFEvent *e;
+
+	for (; *pos < t->nevents; ++*pos) {
+		e = &t->events[*pos];
+		if (e->msg.cmd == EMPTY)
+			continue;
+		if (e->time > *end)
+			*end = e->time;
+		if (e->msg.cmd != ENDOFTRACK)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Merge the `n' tracks `t' into a new track allocated from `a' (which
+ * may be NULL, see `track_new'). Events of the same order are taken
+ * from the tracks in the given sequence. The End Of Track events of the
+ * tracks are replaced by a single one at the end of the new track.
+ * The events are moved, i.e. the given tracks are empty afterwards.
+ * Returns the new track, or NULL on errors, in which case the given
+ * tracks are left untouched.
+ */
+Track *track_merge(Track **t, unsigned long n, Arena *a) {
+	unsigned long *heap, *pos, i, h, total, end;
+	uint64_t *keys;
+	struct vld *vld;
+	MFEvent *e;
+	Track *m;
+
+	total = 1;
+	for (i = 0; i < n; i++) {
+		stop_insertion(t[i]);
+		total += track_nevents(t[i]);
+	}
+
+	heap = malloc(2 * n * sizeof(*heap));
+	keys = malloc(n * sizeof(*keys));
+	m = heap && keys ? track_new(a) : NULL;
+	if (!m || !track_reserve(m, total)) {
+		track_clear(m);
+		free(heap);
+		free(keys);
+		return NULL;
+	}
+	pos = heap + n;
+
+	/* Build the heap of the tracks' first events. */
+	end = 0;
+	for (i = h = 0; i < n; i++) {
+		pos[i] = 0;
+		if (nextmerge(t[i], &pos[i], &end)) {
+			keys[i] = event_key(&t[i]->events[pos[i]]);
+			heap[h++] = i;
+		}
+	}
+	for (i = h / 2; i-- > 0; )
+		siftdown(heap, h, i, keys);
+
+	/* Always take the first event of the track at the top. */
+	while (h > 0) {
+		i = heap[0];
+		e = &m->events[m->nevents++];
+		*e = t[i]->events[pos[i]++];
+		if (a && (vld = message_data(&e->msg)))
+			(void) vld_move(vld, a);
+
+		if (nextmerge(t[i], &pos[i], &end))
+			keys[i] = event_key(&t[i]->events[pos[i]]);
+		else
+			heap[0] = heap[--h];
+		siftdown(heap, h, 0, keys);
+	}
+
+	e = &m->events[m->nevents++];
+	e->time = end;
+	e->msg.cmd = ENDOFTRACK;
+
+	m->sorted = m->current = m->nevents;
+
+	/* The events now belong to `m'. */
+	for (i = 0; i < n; i++) {
+		if (!t[i]->arena)
+			free(t[i]->events);
+		t[i]->events = NULL;
+		t[i]->nevents = t[i]->size = t[i]->sorted = 0;
+		t[i]->current = t[i]->nempty = t[i]->nindex = 0;
+	}
+
+	free(heap);
+	free(keys);
+	return m;
+}
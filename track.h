@@ -3,14 +3,21 @@
 #ifndef __TRACK_H__
 #define __TRACK_H__
 
+#include "arena.h"
 #include "event.h"
 
 /* The track structure itself. */
 typedef struct _Track {
+	Arena         *arena;		/* Source of memory, or NULL. */
 	MFEvent       *events;		/* List of events. */
 	unsigned long nevents;		/* # of total events. */
+	unsigned long size;		/* # of allocated events. */
 	unsigned long current;		/* Index to event in this track. */
 	unsigned long nempty;		/* # of deleted events. */
+	unsigned long sorted;		/* # of leading events in order. */
+	unsigned long *index;		/* Times of every BLOCK-th event. */
+	unsigned long nindex;		/* # of index entries; 0 if stale. */
+	unsigned long isize;		/* # of allocated index entries. */
 	char          inserting;	/* Indicates insertion mode. */
 } Track;
 
@@ -18,15 +25,24 @@ typedef struct _Track {
 typedef unsigned long TrackPos;
 
 /*
- * Build a new track.
+ * Build a new track. If `a' is not NULL, the track, its events and the
+ * data of its events are allocated from the arena `a'. Clearing such a
+ * track doesn't free anything; this is left to `arena_free'.
  * The function returns a pointer to the new (empty) track or NULL on
  * errors.
  */
-Track *track_new(void);
+Track *track_new(Arena *a);
 
 /* Get the number of events in the track. */
 unsigned long track_nevents(Track *t);
 
+/*
+ * Make sure that `n' further events can be inserted without enlarging
+ * the track again.
+ * Returns 1 on success, else 0.
+ */
+int track_reserve(Track *t, unsigned long n);
+
 /*
  * This check for EOT (end of track), which is the position directly
  * after the last event as well as the position directly before the
@@ -63,6 +79,8 @@ MFEvent *track_step(Track *t, int rew);
  * `time'. Returns the found event, or NULL, if EOT is reached.
  * In both cases, the position will be updated, i.e. will be either the
  * position of the found event or EOT.
+ * The search uses an index of the event times, which is rebuilt after
+ * the track has been modified. Thus, don't change event times in place.
  */
 MFEvent *track_find(Track *t, long time);
 
@@ -71,21 +89,61 @@ void track_clear(Track *t);
 
 /*
  * Delete the event at the current position and increase the position,
- * i.e. set the position to the next element.
+ * i.e. set the position to the next element. The event is only marked
+ * as deleted; the track is packed on the next rewind or insertion.
  * If the current position is EOT, or the track is empty at all, return
  * 0, else 1. In other words, this function returns the number of
  * deleted events.
  */
 int track_delete(Track *t);
 
+/*
+ * Remove all events of `t' for which `pred' returns nonzero in a single
+ * pass. `pred' is called for the events in order, with `ctx' as second
+ * argument. The event passed to `pred' is already at its final
+ * position, if it's kept, so its address stays valid until the track is
+ * modified otherwise. Data of removed events is freed.
+ * The position will be EOT. Returns the number of removed events.
+ */
+unsigned long track_remove_if(Track *t, int (*pred)(MFEvent *, void *),
+    void *ctx);
+
 /*
  * Insert the given event `e' into `t'.
  * If there are already events at the time of `e' within `t', `e' will
  * be the last event with this time. It is not possible to insert events
  * in front of a track that already contains events of time 0.
+ * If `t' has an arena, allocated data of `e' is moved into it and must
+ * not be freed by the caller any more.
  * The position will be undefined.
  * This function returns 1 on success, else 0.
  */
 int track_insert(Track *t, MFEvent *e);
 
+/*
+ * Allocate memory for `n' events to replace the events of `t' with
+ * `track_adopt'.
+ * Returns NULL on errors.
+ */
+MFEvent *track_alloc(Track *t, unsigned long n);
+
+/*
+ * Replace the events of `t' by the `n' events at `e', which must be
+ * allocated with `track_alloc' and be sorted. The old events are freed,
+ * but not their data, which is supposed to be moved to `e'.
+ * The position will be EOT.
+ */
+void track_adopt(Track *t, MFEvent *e, unsigned long n);
+
+/*
+ * Merge the `n' tracks `t' into a new track allocated from `a' (which
+ * may be NULL, see `track_new'). Events of the same order are taken
+ * from the tracks in the given sequence. The End Of Track events of the
+ * tracks are replaced by a single one at the end of the new track.
+ * The events are moved, i.e. the given tracks are empty afterwards.
+ * Returns the new track, or NULL on errors, in which case the given
+ * tracks are left untouched.
+ */
+Track *track_merge(Track **t, unsigned long n, Arena *a);
+
 #endif /*  __TRACK_H__ */
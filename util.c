@@ -5,6 +5,169 @@
 
 #include "util.h"
 
+/*
+ * State of `pairNotes'. The open notes of each channel and key are kept
+ * in a LIFO stack. Stack entries come from a pool; entries and links are
+ * pool indices + 1, 0 means none.
+ */
+struct pairing {
+	struct note {
+		MFEvent *e;
+		unsigned long n;	/* Next entry of stack or free list. */
+	} *pool;
+	unsigned long npool;	/* # of allocated entries. */
+	unsigned long used;	/* # of used entries. */
+	unsigned long freed;	/* Free list. */
+	unsigned long notes[16][128];
+	int non, noff;		/* # of unmatched NoteOn and NoteOff events. */
+	int failed;		/* Nonzero if the pool couldn't grow. */
+};
+
+/*
+ * Push `e' onto the stack `top' of `p'.
+ * Returns 1 on success, else 0.
+ */
+static int pushnote(struct pairing *p, unsigned long *top, MFEvent *e) {
+	struct note *n;
+	unsigned long i, size;
+
+	if (p->freed) {
+		i = p->freed;
+		p->freed = p->pool[i - 1].n;
+	} else {
+		if (p->used == p->npool) {
+			size = p->npool ? 2 * p->npool : 256;
+			if (!(n = realloc(p->pool, size * sizeof(*n))))
+				return 0;
+			p->pool = n;
+			p->npool = size;
+		}
+		i = ++p->used;
+	}
+
+	p->pool[i - 1].e = e;
+	p->pool[i - 1].n = *top;
+	*top = i;
+	return 1;
+}
+
+/* Pop the top event off the stack `top', which must not be empty. */
+static MFEvent *popnote(struct pairing *p, unsigned long *top) {
+	unsigned long i = *top;
+
+	*top = p->pool[i - 1].n;
+	p->pool[i - 1].n = p->freed;
+	p->freed = i;
+	return p->pool[i - 1].e;
+}
+
+/* Combined Note events, see `pairNotes'. */
+#define isNote(e)	(((e)->msg.cmd & 0xf0) == NOTEON && \
+			(e)->msg.noteon.duration != 0)
+
+/*
+ * Pending NoteOff events of `unpairNotes'. This is a heap ordered by
+ * the events' keys and creation sequence.
+ */
+struct unpairing {
+	struct off {
+		uint64_t key;
+		unsigned long seq;
+		MFEvent e;
+	} *offs;
+	unsigned long noffs;	/* # of pending events. */
+	unsigned long seq;	/* Sequence number of next event. */
+};
+
+/* Returns nonzero if `a' is to be written before `b'. */
+#define offbefore(a, b)	((a)->key < (b)->key || \
+			((a)->key == (b)->key && (a)->seq < (b)->seq))
+
+/*
+ * Create the NoteOff event for the combined Note event `on'. There must
+ * be room for it in `u->offs'.
+ */
+static void pushoff(struct unpairing *u, const MFEvent *on) {
+	struct off x;
+	unsigned long i;
+
+	x.e.time = on->time + on->msg.noteon.duration;
+	x.e.msg.cmd = NOTEOFF | CHN(on->msg);
+	x.e.msg.noteoff.note = on->msg.noteon.note;
+	x.e.msg.noteoff.velocity = on->msg.noteon.release;
+	x.key = event_key(&x.e);
+	x.seq = u->seq++;
+
+	for (i = u->noffs++; i > 0 && offbefore(&x, &u->offs[(i - 1) / 2]);
+	    i = (i - 1) / 2)
+		u->offs[i] = u->offs[(i - 1) / 2];
+	u->offs[i] = x;
+}
+
+/* Remove the first pending NoteOff event and store it at `e'. */
+static void popoff(struct unpairing *u, MFEvent *e) {
+	struct off *offs = u->offs;
+	unsigned long i, c;
+	struct off x;
+
+	*e = offs[0].e;
+	x = offs[--u->noffs];
+	for (i = 0; (c = 2 * i + 1) < u->noffs; i = c) {
+		if (c + 1 < u->noffs && offbefore(&offs[c + 1], &offs[c]))
+			c++;
+		if (!offbefore(&offs[c], &x))
+			break;
+		offs[i] = offs[c];
+	}
+	offs[i] = x;
+}
+
+/*
+ * Pair the NoteOff event `e' with the last open note, or open a new
+ * note, see `pairNotes'. `ctx' is the state of the pairing.
+ * Returns 1 if `e' is to be removed.
+ */
+static int pairnote(MFEvent *e, void *ctx) {
+	struct pairing *p = ctx;
+	unsigned long *top;
+	MFEvent *on;
+
+	if (p->failed)
+		return 0;
+
+	switch (e->msg.cmd & 0xf0) {
+	case NOTEON:
+		if (e->msg.noteon.velocity != 0) {
+			if (e->msg.noteon.duration == 0) {
+				if (e->msg.noteon.note < 128 &&
+				    !pushnote(p, &p->notes[CHN(e->msg)]
+				    [e->msg.noteon.note], e))
+					p->failed = 1;
+				p->non++;
+			}
+			break;
+		}
+		/* NoteOn events with vel. 0 fall through the MFNoteOff case. */
+	case NOTEOFF:
+		if (e->msg.noteoff.note > 127 ||
+		    !*(top = &p->notes[CHN(e->msg)][e->msg.noteoff.note]))
+			/* Unmatched NoteOff */
+			p->noff++;
+		else {
+			on = popnote(p, top);
+			on->msg.noteon.duration = e->time - on->time;
+			on->msg.noteon.release = e->msg.noteon.velocity;
+			p->non--;
+			return 1;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
 /*
  * Convert NoteOn/NoteOff pairs into combined Note Events. For each NoteOff
  * event, the last corresponding NoteOn event will get the release
@@ -20,61 +183,22 @@
  *   110 Note ch=1, n=60, dur=10
  *
  * This function returns the number of unmatched events (NoteOn *and*
- * NoteOff).
+ * NoteOff), or -1 if memory ran out; the notes paired until then stay
+ * paired.
  */
 int pairNotes(Track *t) {
-	MFEvent *e;
-	int non = 0, noff = 0;
+	struct pairing *p;
+	int n;
 
-	struct _n {
-		MFEvent *e;
-		struct _n *n;
-	} *notes = NULL, *nn;
+	if (!(p = calloc(1, sizeof(*p))))
+		return -1;
 
-	track_rewind(t);
-	while ((e = track_step(t, 0)) != NULL)
-		switch (e->msg.cmd & 0xf0) {
-		case NOTEON:
-			if (e->msg.noteon.velocity != 0) {
-				if (e->msg.noteon.duration == 0) {
-					nn = alloca(sizeof(*nn));
-					nn->n = notes;
-					nn->e = e;
-					notes = nn;
-					non++;
-				}
-				break;
-			}
-			/* NoteOn events with vel. 0 fall through the MFNoteOff case. */
-		case NOTEOFF:
-			if (!non)
-				/* NoteOff without any NoteOn, i.e. unmatched NoteOff */
-				noff++;
-			else {
-				nn = notes;
-				while (nn && (nn->e == NULL ||
-				    CHN(nn->e->msg) != CHN(e->msg) ||
-				    CHN(nn->e->msg) != CHN(e->msg)))
-					nn = nn->n;
-
-				if (!nn)
-					/* Unmatched NoteOff */
-					noff++;
-				else {
-					nn->e->msg.noteon.duration = e->time - nn->e->time;
-					nn->e->msg.noteon.release = e->msg.noteon.velocity;
-					nn->e = NULL;
-					track_delete(t);
-					track_step(t, 1);
-					non--;
-				}
-			}
-			break;
-		default:
-			break;
-		}
+	(void) track_remove_if(t, pairnote, p);
 
-	return non + noff;
+	n = p->failed ? -1 : p->non + p->noff;
+	free(p->pool);
+	free(p);
+	return n;
 }
 
 /*
@@ -82,46 +206,57 @@ int pairNotes(Track *t) {
  * corresponding NoteOff event is created and the duration and release
  * velocity fields are reset to 0.
  * This function doesn't adjust possible EOT events!
- * Returns the number of converted events.
+ * Returns the number of converted events, or -1 if memory ran out; the
+ * track is unchanged then.
  */
 int unpairNotes(Track *t) {
-	Track *tt;
-	MFEvent *e;
-	long n = 0;
+	struct unpairing u;
+	MFEvent *e, *new;
+	unsigned long i, n = 0;
+	uint64_t key;
 
-	/* The temporary track tt holds all NoteOff events to be inserted. */
-	if (!(tt = track_new())) {
-		perror("unpair");
-		exit(EXIT_FAILURE);
+	track_rewind(t);
+	while ((e = track_step(t, 0)) != NULL)
+		if (isNote(e))
+			n++;
+
+	if (!n)
+		return 0;
+
+	/* At most all NoteOff events are pending at once. */
+	if (!(u.offs = malloc(n * sizeof(*u.offs))))
+		return -1;
+	if (!(new = track_alloc(t, track_nevents(t) + n))) {
+		free(u.offs);
+		return -1;
 	}
 
+	/*
+	 * Merge the NoteOff events into the track while copying it. They
+	 * are created in order of their NoteOn events and go behind any
+	 * equal events of the track, just as if they were inserted.
+	 */
+	u.noffs = u.seq = 0;
+	i = 0;
 	track_rewind(t);
+	while ((e = track_step(t, 0)) != NULL) {
+		key = event_key(e);
+		while (u.noffs && u.offs[0].key < key)
+			popoff(&u, &new[i++]);
 
-	while ((e = track_step(t, 0)) != NULL)
-		if ((e->msg.cmd & 0xf0) == NOTEON &&
-			e->msg.noteon.duration != 0) {
-		MFEvent _o, *o = &_o;
-		o->time = e->time + e->msg.noteon.duration;
-		o->msg.cmd = NOTEOFF | CHN(e->msg);
-		o->msg.noteoff.note = e->msg.noteon.note;
-		o->msg.noteoff.velocity = e->msg.noteon.release;
-		e->msg.noteon.duration = 0;
-		e->msg.noteon.release = 0;
-		if (!track_insert(tt, o)) {
-			perror("unpair");
-			exit(EXIT_FAILURE);
+		new[i] = *e;
+		if (isNote(e)) {
+			pushoff(&u, e);
+			new[i].msg.noteon.duration = 0;
+			new[i].msg.noteon.release = 0;
 		}
-		n++;
+		i++;
 	}
+	while (u.noffs)
+		popoff(&u, &new[i++]);
 
-	track_rewind(tt);
-	while ((e = track_step(tt, 0)) != NULL)
-		if (!track_insert(t, e)) {
-			perror("unpair");
-			exit(EXIT_FAILURE);
-		}
-
-	track_clear(tt);
+	track_adopt(t, new, i);
+	free(u.offs);
 
 	return n;
 }
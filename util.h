@@ -20,7 +20,8 @@
  *   110 Note ch=1, n=60, dur=10
  *
  * This function returns the number of unmatched events (NoteOn *and*
- * NoteOff).
+ * NoteOff), or -1 if memory ran out; the notes paired until then stay
+ * paired.
  */
 int pairNotes(Track *t);
 
@@ -29,7 +30,8 @@ int pairNotes(Track *t);
  * corresponding NoteOff event is created and the duration and release
  * velocity fields are reset to 0.
  * This function doesn't adjust possible EOT events!
- * Returns the number of converted events.
+ * Returns the number of converted events, or -1 if memory ran out; the
+ * track is unchanged then.
  */
 int unpairNotes(Track *t);
 
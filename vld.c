@@ -9,6 +9,18 @@
 #include "print.h"
 #include "vld.h"
 
+/*
+ * If nonzero, `read_vld' doesn't copy the data out of buffers that keep
+ * it in place but borrows it.
+ */
+int vld_borrow = 0;
+
+/*
+ * If not NULL, data that can't be borrowed is allocated from here. Each
+ * thread has its own, so that scores can be read in several at once.
+ */
+_Thread_local Arena *vld_arena = NULL;
+
 /*
  * Read a variable length quantity (e.g. delta time) from the buffer.
  * If an error occurs (too large value), -1 is returned and the buffer
@@ -17,11 +29,11 @@
  */
 long read_vlq(MBUF *b) {
 	long vlq = 0;
-	unsigned long p = mbuf_pos(b);
+	unsigned long p = mbuf_tell(b);
 	int n = 0;
 	unsigned char c = 0;
 
-	while (mbuf_request(b, 1) && n++ < 4 && (c = mbuf_get(b)) & 0x80)
+	while (mbuf_have(b, 1) && n++ < 4 && (c = mbuf_getc(b)) & 0x80)
 		vlq = vlq << 7 | (c & 0x7f);
 
 	if (n < 1) {
@@ -48,60 +60,67 @@ long read_vlq(MBUF *b) {
  * of bytes written.
  */
 int write_vlq(MBUF *b, long vlq) {
-	char buf[4];
-	int i, result;
+	unsigned char buf[4];
+	int i;
 
 	if (vlq < 0 || vlq > 0x0fffffff) {
 		midiprint(MPFatal, "writing vlq: out of range");
 		return 0;
 	}
 
-	result = 0;
-	buf[result++] = vlq & 0x7f;
+	/* Fill the buffer from the end, least significant group first. */
+	i = sizeof(buf);
+	buf[--i] = vlq & 0x7f;
 	while (vlq > 0x7f) {
 		vlq >>= 7;
-		buf[result++] = 0x80 | (vlq & 0x7f);
+		buf[--i] = 0x80 | (vlq & 0x7f);
 	}
 
-	i = result;
-	while (i-- > 0)
-		if (mbuf_put(b, buf[i]) == EOF)
-			return 0;
+	if (mbuf_write(b, buf + i, sizeof(buf) - i))
+		return 0;
 
-	return result;
+	return sizeof(buf) - i;
 }
 
 /*
- * Read variable length data, i.e. a vlq and following data bytes.
- * Returns the data pointer, or NULL on error.
+ * Read variable length data, i.e. a vlq and following data bytes, into
+ * `vld'.
+ * Returns 1 on success, or 0 on error.
  */
-struct vld *read_vld(MBUF *b) {
-	unsigned long p = mbuf_pos(b);
+int read_vld(MBUF *b, struct vld *vld) {
+	unsigned long p = mbuf_tell(b);
 	long length;
-	struct vld *vld;
-	unsigned char *ptr;
 
 	if ((length = read_vlq(b)) < 0)
-		return NULL;
+		return 0;
 
-	if (!mbuf_request(b, length)) {
+	if (!mbuf_have(b, length)) {
 		midiprint(MPError, "reading vld: end of input");
 		mbuf_set(b, p);
-		return NULL;
+		return 0;
+	}
+
+	vld->length = length;
+	if (vld_borrow && mbuf_stable(b)) {
+		vld->data = (unsigned char*)mbuf_borrow(b, length);
+		vld->borrowed = 1;
+		return 1;
 	}
 
-	if (!(vld = malloc(sizeof(*vld) + length))) {
+	if (vld_arena)
+		vld->data = arena_alloc(vld_arena, length);
+	else
+		vld->data = malloc(length ? length : 1);
+	if (!vld->data) {
 		midiprint(MPFatal, "%s", strerror(errno));
 		mbuf_set(b, p);
-		return NULL;
+		return 0;
 	}
 
-	vld->length = length;
-	ptr = vld->data;
-	while (length--)
-		*ptr++ = mbuf_get(b);
+	vld->borrowed = vld_arena != NULL;
+	(void) mbuf_read(b, vld->data, length);
 
-	return vld;
+	return 1;
 }
 
 /*
@@ -110,16 +129,42 @@ struct vld *read_vld(MBUF *b) {
  */
 long write_vld(MBUF *b, const struct vld *vld) {
 	long length = vld->length;
-	const unsigned char *data = vld->data;
 	long result;
 
-	if (!(result = write_vlq(b, length)))
+	if (mbuf_reserve(b, 4 + length) || !(result = write_vlq(b, length)))
+		return 0;
+
+	if (mbuf_write(b, vld->data, length))
+		return 0;
+
+	return result + length;
+}
+
+/*
+ * Move allocated data of `vld' into the arena `a'.
+ * Returns 1 on success, or 0 on error.
+ */
+int vld_move(struct vld *vld, Arena *a) {
+	unsigned char *data;
+
+	if (vld->borrowed)
+		return 1;
+
+	if (!(data = arena_alloc(a, vld->length)))
 		return 0;
 
-	result += length;
-	while (length-- > 0)
-		if (mbuf_put(b, *data++) == EOF)
-			return 0;
+	memcpy(data, vld->data, vld->length);
+	free(vld->data);
+	vld->data = data;
+	vld->borrowed = 1;
+	return 1;
+}
 
-	return result;
+/* Free allocated data and reset `vld' to the empty state. */
+void vld_clear(struct vld *vld) {
+	if (!vld->borrowed)
+		free(vld->data);
+	vld->length = 0;
+	vld->data = NULL;
+	vld->borrowed = 0;
 }
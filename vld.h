@@ -3,13 +3,34 @@
 #ifndef __VLD_H__
 #define __VLD_H__
 
+#include "arena.h"
 #include "buffer.h"
 
+/*
+ * Variable length data. The data is either allocated or, if `borrowed'
+ * is set, belongs to something else, i.e. the buffer it was read from
+ * or an arena. Borrowed data must not be freed or modified.
+ */
 struct vld {
 	long length;
-	unsigned char data[];
+	unsigned char *data;
+	char borrowed;
 };
 
+/*
+ * If nonzero, `read_vld' doesn't copy the data out of buffers that keep
+ * it in place (see `mbuf_stable') but borrows it. Such buffers must not
+ * be changed or freed while the data is in use.
+ */
+extern int vld_borrow;
+
+/*
+ * If not NULL, data that `read_vld' can't borrow is allocated from this
+ * arena instead of the heap (and marked as borrowed). Each thread has
+ * its own.
+ */
+extern _Thread_local Arena *vld_arena;
+
 /*
  * Read a variable length quantity (e.g. delta time) from the buffer.
  * If an error occurs (too large value), -1 is returned and the buffer
@@ -27,10 +48,11 @@ long read_vlq(MBUF *b);
 int write_vlq(MBUF *b, long vlq);
 
 /*
- * Read variable length data, i.e. a vlq and following data bytes.
- * Returns the data pointer, or NULL on error.
+ * Read variable length data, i.e. a vlq and following data bytes, into
+ * `vld'.
+ * Returns 1 on success, or 0 on error.
  */
-struct vld *read_vld(MBUF *b);
+int read_vld(MBUF *b, struct vld *vld);
 
 /*
  * Write variable length data, i.e. a vlq and following data bytes.
@@ -38,4 +60,14 @@ struct vld *read_vld(MBUF *b);
  */
 long write_vld(MBUF *b, const struct vld *vld);
 
+/*
+ * Move allocated data of `vld' into the arena `a', so that it is freed
+ * together with it.
+ * Returns 1 on success, or 0 on error.
+ */
+int vld_move(struct vld *vld, Arena *a);
+
+/* Free allocated data and reset `vld' to the empty state. */
+void vld_clear(struct vld *vld);
+
 #endif /* __VLD_H__ */